@@ -0,0 +1,167 @@
+#ifndef __ASSETLOADER_H_
+#define __ASSETLOADER_H_
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <stdexcept>
+
+#include "Parallel.hpp"
+#include "Mesh.hpp"
+#include "MeshCache.hpp"
+#include "LSystem.hpp"
+#include "LSystemReader.hpp"
+#include "bmpread.c"
+
+using std::string;
+using std::map;
+using std::runtime_error;
+
+// reads meshes, L-systems and bitmaps on worker threads, so files are read
+// at the same time as each other and as the window and GL are set up
+// files are started with load and handed over with take, as a future the
+// GL thread picks up and uploads once it's ready, so they can be started
+// as early as possible and taken later wherever they're needed
+// taking a file hands over what's read from it, to be freed by the taker
+class AssetLoader {
+	private:
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable wake; // a new task, or stopping
+		std::deque<std::function<void()> > tasks;
+		bool stopping;
+
+		map<string, std::shared_future<Mesh*> > meshes;
+		map<string, std::shared_future<LSystem*> > lsystems;
+		map<string, std::shared_future<bmpread_t*> > bitmaps;
+
+		void workerLoop() {
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true) {
+				wake.wait(lock, [&]() { return stopping || !tasks.empty(); });
+				if(stopping) {
+					return;
+				}
+				std::function<void()> task = tasks.front();
+				tasks.pop_front();
+				lock.unlock();
+				task();
+				lock.lock();
+			}
+		}
+
+		// run read on a worker, its result or what it throws goes in the future
+		// threads are only started once there's something to read
+		template<typename T, typename Func>
+		std::shared_future<T> start(Func read) {
+			std::shared_ptr<std::packaged_task<T()> > task(new std::packaged_task<T()>(read));
+			std::shared_future<T> result = task->get_future().share();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if(threads.empty()) {
+					for(unsigned i = 0; i < workerCount(); i++) {
+						threads.push_back(std::thread(&AssetLoader::workerLoop, this));
+					}
+				}
+				tasks.push_back([task]() { (*task)(); });
+			}
+			wake.notify_one();
+			return result;
+		}
+
+		template<typename T>
+		static std::shared_future<T> take(map<string, std::shared_future<T> >& loads, const string& path) {
+			typename map<string, std::shared_future<T> >::iterator found = loads.find(path);
+			std::shared_future<T> result = found->second;
+			loads.erase(found);
+			return result;
+		}
+
+	public:
+		AssetLoader() {
+			stopping = false;
+		}
+
+		// files still waiting are dropped, ones being read are finished
+		~AssetLoader() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for(std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it) {
+				it->join();
+			}
+		}
+
+		// start reading a PLY file through the mesh cache, unless it's
+		// already being read, for takeMesh to pick up
+		void loadMesh(const string& path) {
+			if(meshes.find(path) == meshes.end()) {
+				meshes[path] = start<Mesh*>([path]() {
+					return meshCache.load(path.c_str());
+				});
+			}
+		}
+
+		void loadLSystem(const string& path) {
+			if(lsystems.find(path) == lsystems.end()) {
+				lsystems[path] = start<LSystem*>([path]() {
+					LSystemReader reader(path.c_str());
+					return reader.read();
+				});
+			}
+		}
+
+		void loadBitmap(const string& path) {
+			if(bitmaps.find(path) == bitmaps.end()) {
+				bitmaps[path] = start<bmpread_t*>([path]() {
+					bmpread_t* bitmap = new bmpread_t;
+					if(!bmpread(path.c_str(), 0, bitmap)) {
+						delete bitmap;
+						throw runtime_error("failed to load texture: " + path);
+					}
+					return bitmap;
+				});
+			}
+		}
+
+		// the mesh being read from path, started now if it wasn't already
+		// the loader forgets it, so asking again reads it again, and the
+		// caller is responsible for deleting Mesh when done
+		std::shared_future<Mesh*> takeMesh(const string& path) {
+			loadMesh(path);
+			return take(meshes, path);
+		}
+
+		// caller is responsible for deleting LSystem when done
+		std::shared_future<LSystem*> takeLSystem(const string& path) {
+			loadLSystem(path);
+			return take(lsystems, path);
+		}
+
+		// caller is responsible for calling bmpread_free and deleting it
+		std::shared_future<bmpread_t*> takeBitmap(const string& path) {
+			loadBitmap(path);
+			return take(bitmaps, path);
+		}
+
+		// true if future has its result, or what went wrong, already
+		template<typename T>
+		static bool isReady(const std::shared_future<T>& future) {
+			return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		}
+};
+
+// for reading every file the program starts with
+static AssetLoader assetLoader;
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef __BENCHMARK_H_
+#define __BENCHMARK_H_
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <cmath>
+
+#ifndef _WIN32
+	#include <EGL/egl.h>
+	#include <EGL/eglext.h>
+#endif
+
+#include "Angel.h"
+#include "Scene.hpp"
+#include "RenderStats.hpp"
+
+using std::vector;
+using std::runtime_error;
+using std::cout;
+using std::endl;
+
+// a GL context with no window, rendering into a framebuffer object
+// uses EGL without a surface, which Mesa's llvmpipe provides on machines
+// with no display or GPU
+class OffscreenContext {
+	private:
+#ifndef _WIN32
+		EGLDisplay display;
+		EGLContext context;
+#endif
+		GLuint framebuffer;
+		GLuint renderbuffers[2]; // color, depth
+
+	public:
+		OffscreenContext() {
+#ifdef _WIN32
+			throw runtime_error("offscreen rendering needs EGL");
+#else
+			display = EGL_NO_DISPLAY;
+			PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+				(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+			if(getPlatformDisplay != NULL) {
+				display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			}
+			if(display == EGL_NO_DISPLAY) {
+				display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+			}
+			EGLint major, minor;
+			if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+				throw runtime_error("no EGL display");
+			}
+			eglBindAPI(EGL_OPENGL_API);
+
+			// no surface, so any surface type will do (the default wants windows)
+			EGLint configAttributes[] = {
+				EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+				EGL_SURFACE_TYPE, 0,
+				EGL_NONE
+			};
+			EGLConfig config;
+			EGLint numConfigs;
+			if(!eglChooseConfig(display, configAttributes, &config, 1, &numConfigs) || numConfigs == 0) {
+				throw runtime_error("no EGL config for desktop GL");
+			}
+			// same version the window asks glut for
+			EGLint contextAttributes[] = {
+				EGL_CONTEXT_MAJOR_VERSION, 3,
+				EGL_CONTEXT_MINOR_VERSION, 1,
+				EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+				EGL_NONE
+			};
+			context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+			if(context == EGL_NO_CONTEXT
+					|| !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+				throw runtime_error("couldn't make a surfaceless EGL context current");
+			}
+#endif
+		}
+
+		// set up the framebuffer to draw into, needs GL functions loaded
+		void createFramebuffer(int width, int height) {
+			glGenFramebuffers(1, &framebuffer);
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+			glGenRenderbuffers(2, renderbuffers);
+			glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+					GL_RENDERBUFFER, renderbuffers[0]);
+			glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+			glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+					GL_RENDERBUFFER, renderbuffers[1]);
+			if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+				throw runtime_error("offscreen framebuffer is incomplete");
+			}
+		}
+
+		~OffscreenContext() {
+#ifndef _WIN32
+			eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(display, context);
+			eglTerminate(display);
+#endif
+		}
+};
+
+// renders a scene along a fixed camera path and reports how long frames took
+// the camera orbits the forest once over all the frames, looking at its middle
+// works with GL or the scene's software rasterizer
+class Benchmark {
+	private:
+		Scene* scene;
+		LSystemRenderer* lsysRenderer;
+		SoftwareRasterizer* rasterizer; // NULL with GL
+
+		// wait for everything drawn so far
+		void finish() {
+			if(rasterizer == NULL) {
+				glFinish();
+			}
+		}
+
+		static const unsigned warmupFrames = 3;
+
+		// camera for frame of frames
+		void placeCamera(unsigned frame, unsigned frames) {
+			vec3 center(-10, 10, -10);
+			float angle = 2 * M_PI * frame / frames;
+			vec3 eye = center + vec3(45 * cos(angle), 35, 45 * sin(angle));
+			scene->getCamera().lookAt(eye, center, vec3(0, 1, 0));
+		}
+
+		// value below which fraction of the sorted times fall
+		static double percentile(const vector<double>& sorted, double fraction) {
+			size_t rank = (size_t)ceil(fraction * sorted.size());
+			return sorted[std::max(rank, (size_t)1) - 1];
+		}
+
+	public:
+		Benchmark(Scene* scene, LSystemRenderer* lsysRenderer) {
+			this->scene = scene;
+			this->lsysRenderer = lsysRenderer;
+			rasterizer = scene->getRasterizer();
+		}
+
+		// render frames and print frame time percentiles and the average work
+		// per frame, frames are finished before they're timed
+		void run(unsigned frames) {
+			while(lsysRenderer->batchPending()) {
+				lsysRenderer->updateBatch();
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+			for(unsigned frame = 0; frame < warmupFrames; frame++) {
+				placeCamera(frame, frames);
+				scene->render();
+			}
+			finish();
+
+			vector<double> times;
+			unsigned long long drawCalls = 0;
+			unsigned long long triangles = 0;
+			for(unsigned frame = 0; frame < frames; frame++) {
+				placeCamera(frame, frames);
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				scene->render();
+				finish();
+				std::chrono::duration<double, std::milli> elapsed =
+					std::chrono::steady_clock::now() - start;
+				times.push_back(elapsed.count());
+				drawCalls += renderStats.drawCalls;
+				triangles += renderStats.triangles;
+			}
+
+			double total = 0;
+			for(vector<double>::const_iterator i = times.begin(); i != times.end(); ++i) {
+				total += *i;
+			}
+			std::sort(times.begin(), times.end());
+			cout << "bench: " << frames << " frames on ";
+			if(rasterizer != NULL) {
+				cout << "the software rasterizer, " << rasterizer->getThreadCount() << " threads" << endl;
+			} else {
+				cout << glGetString(GL_RENDERER) << endl;
+			}
+			cout << "frame ms: mean=" << total / frames << ", p50=" << percentile(times, 0.5)
+				<< ", p90=" << percentile(times, 0.9) << ", p99=" << percentile(times, 0.99)
+				<< ", max=" << times.back() << endl;
+			cout << "per frame: draw calls=" << drawCalls / frames
+				<< ", triangles=" << triangles / frames << endl;
+		}
+};
+
+#endif
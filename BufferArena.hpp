@@ -0,0 +1,242 @@
+#ifndef __BUFFERARENA_H_
+#define __BUFFERARENA_H_
+
+#include <map>
+#include <algorithm>
+#include <iostream>
+
+#include "Angel.h"
+
+using std::map;
+using std::cout;
+using std::endl;
+
+// bytes handed out by a BufferArena
+// offset changes if the arena defragments, so read it when drawing
+struct BufferRange {
+	GLintptr offset;
+	GLsizeiptr size;
+};
+
+// sub-allocates ranges of one big GL buffer, so things can be added and
+// removed without touching anything else in it
+// freed ranges are reused first fit and merged with their neighbours, the
+// buffer doubles when nothing fits, and defragment() packs everything in
+// use to the front
+// the buffer keeps its name when it grows, so vertex arrays pointing into
+// it stay valid
+// uploads and copies go through the copy targets, so no other binding is
+// disturbed
+class BufferArena {
+	private:
+		GLuint buffer;
+		GLsizeiptr capacity;
+		GLsizeiptr alignment; // every range starts and ends on a multiple of this
+		GLsizeiptr usedBytes;
+		map<GLintptr, GLsizeiptr> freeRanges; // offset to size, never touching each other
+		map<GLintptr, BufferRange*> usedRanges; // by offset
+
+		GLsizeiptr align(GLsizeiptr size) {
+			return (size + alignment - 1) / alignment * alignment;
+		}
+
+		// put [offset, offset + size) back on the free list, merged with
+		// the free ranges either side of it
+		void addFree(GLintptr offset, GLsizeiptr size) {
+			map<GLintptr, GLsizeiptr>::iterator next = freeRanges.lower_bound(offset);
+			if(next != freeRanges.end() && offset + size == next->first) {
+				size += next->second;
+				next = freeRanges.erase(next);
+			}
+			if(next != freeRanges.begin()) {
+				map<GLintptr, GLsizeiptr>::iterator prev = next;
+				--prev;
+				if(prev->first + prev->second == offset) {
+					prev->second += size;
+					return;
+				}
+			}
+			freeRanges[offset] = size;
+		}
+
+		// copy the first bytes of the buffer into a new buffer
+		GLuint copyOut(GLsizeiptr bytes) {
+			GLuint copy;
+			glGenBuffers(1, &copy);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, copy);
+			glBufferData(GL_COPY_WRITE_BUFFER, bytes, NULL, GL_STREAM_COPY);
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			if(bytes > 0) {
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, bytes);
+			}
+			return copy;
+		}
+
+		// make room for at least newCapacity bytes, keeping the contents
+		void grow(GLsizeiptr newCapacity) {
+			GLsizeiptr oldCapacity = capacity;
+			GLuint copy = copyOut(oldCapacity);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferData(GL_COPY_WRITE_BUFFER, newCapacity, NULL, GL_STATIC_DRAW);
+			glBindBuffer(GL_COPY_READ_BUFFER, copy);
+			if(oldCapacity > 0) {
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldCapacity);
+			}
+			glDeleteBuffers(1, &copy);
+			capacity = newCapacity;
+			addFree(oldCapacity, newCapacity - oldCapacity);
+		}
+
+	public:
+		BufferArena(GLsizeiptr initialCapacity = 0, GLsizeiptr alignment = 16) {
+			this->alignment = alignment;
+			capacity = 0;
+			usedBytes = 0;
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferData(GL_COPY_WRITE_BUFFER, 0, NULL, GL_STATIC_DRAW);
+			reserve(initialCapacity);
+		}
+
+		~BufferArena() {
+			for(map<GLintptr, BufferRange*>::iterator i = usedRanges.begin(); i != usedRanges.end(); ++i) {
+				delete i->second;
+			}
+			glDeleteBuffers(1, &buffer);
+		}
+
+		GLuint getBuffer() {
+			return buffer;
+		}
+
+		// grow now so the next allocations up to bytes in all don't have to
+		void reserve(GLsizeiptr bytes) {
+			bytes = align(bytes);
+			if(bytes > capacity) {
+				grow(bytes);
+			}
+		}
+
+		// size bytes somewhere in the buffer, contents undefined until uploaded
+		BufferRange* allocate(GLsizeiptr size) {
+			size = std::max(align(size), alignment);
+			map<GLintptr, GLsizeiptr>::iterator fit = freeRanges.begin();
+			while(fit != freeRanges.end() && fit->second < size) {
+				++fit;
+			}
+			if(fit == freeRanges.end()) {
+				// whatever is free at the end counts towards the new space
+				GLsizeiptr tail = 0;
+				if(!freeRanges.empty()) {
+					map<GLintptr, GLsizeiptr>::iterator last = --freeRanges.end();
+					if(last->first + last->second == capacity) {
+						tail = last->second;
+					}
+				}
+				grow(std::max(capacity * 2, capacity + size - tail));
+				fit = --freeRanges.end();
+			}
+
+			BufferRange* range = new BufferRange();
+			range->offset = fit->first;
+			range->size = size;
+			GLsizeiptr left = fit->second - size;
+			freeRanges.erase(fit);
+			if(left > 0) {
+				freeRanges[range->offset + size] = left;
+			}
+			usedRanges[range->offset] = range;
+			usedBytes += size;
+			return range;
+		}
+
+		// copy bytes of data to offset bytes into range
+		void upload(BufferRange* range, const void* data, GLsizeiptr bytes, GLintptr offset = 0) {
+			if(bytes <= 0) {
+				return;
+			}
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, range->offset + offset, bytes, data);
+		}
+
+		// give back a range from allocate, which is deleted
+		void release(BufferRange* range) {
+			if(range == NULL) {
+				return;
+			}
+			usedRanges.erase(range->offset);
+			usedBytes -= range->size;
+			addFree(range->offset, range->size);
+			delete range;
+		}
+
+		// pack every range in use to the front of the buffer, in the order
+		// they're in now, so all the free space is in one piece at the end
+		// returns true if anything moved
+		bool defragment() {
+			if(freeRanges.empty() || (freeRanges.size() == 1
+					&& freeRanges.begin()->first + freeRanges.begin()->second == capacity)) {
+				return false;
+			}
+			// gather the ranges into a scratch buffer, then copy that back
+			GLuint packed;
+			glGenBuffers(1, &packed);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, packed);
+			glBufferData(GL_COPY_WRITE_BUFFER, usedBytes, NULL, GL_STREAM_COPY);
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			GLintptr next = 0;
+			map<GLintptr, BufferRange*> moved;
+			for(map<GLintptr, BufferRange*>::iterator i = usedRanges.begin(); i != usedRanges.end(); ++i) {
+				BufferRange* range = i->second;
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+						range->offset, next, range->size);
+				range->offset = next;
+				moved[next] = range;
+				next += range->size;
+			}
+			glBindBuffer(GL_COPY_READ_BUFFER, packed);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			if(usedBytes > 0) {
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, usedBytes);
+			}
+			glDeleteBuffers(1, &packed);
+
+			usedRanges.swap(moved);
+			freeRanges.clear();
+			if(usedBytes < capacity) {
+				freeRanges[usedBytes] = capacity - usedBytes;
+			}
+			return true;
+		}
+
+		GLsizeiptr getCapacity() {
+			return capacity;
+		}
+
+		GLsizeiptr getUsedBytes() {
+			return usedBytes;
+		}
+
+		GLsizeiptr getFreeBytes() {
+			return capacity - usedBytes;
+		}
+
+		// how much of the free space is unusable for the biggest allocation
+		// that would fit in all of it, 0 when it's all in one piece
+		float getFragmentation() {
+			GLsizeiptr largest = 0;
+			for(map<GLintptr, GLsizeiptr>::iterator i = freeRanges.begin(); i != freeRanges.end(); ++i) {
+				largest = std::max(largest, i->second);
+			}
+			GLsizeiptr free = getFreeBytes();
+			return free > 0 ? 1 - (float)largest / free : 0;
+		}
+
+		void print(const char* name) {
+			cout << name << ": " << usedBytes / 1024 << " KB used of " << capacity / 1024
+				<< " KB in " << usedRanges.size() << " ranges, " << freeRanges.size()
+				<< " free ranges" << endl;
+		}
+};
+
+#endif
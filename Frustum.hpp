@@ -0,0 +1,138 @@
+#ifndef __FRUSTUM_H_
+#define __FRUSTUM_H_
+
+#include <algorithm>
+
+#include "Angel.h"
+#include "RenderStats.hpp"
+
+// the six clipping planes of a view, for testing boxes against it
+class ViewFrustum {
+	private:
+		vec4 planes[6]; // a point p is inside a plane if dot(plane, p) >= 0
+
+	public:
+		// clip space is -w <= x, y, z <= w, so each plane is the last row of
+		// the (row major) matrix plus or minus one of the others
+		// planes end up in whatever space the matrix transforms from
+		void setMatrix(mat4 matrix) {
+			for(int axis = 0; axis < 3; axis++) {
+				planes[axis * 2] = matrix[3] + matrix[axis];
+				planes[axis * 2 + 1] = matrix[3] - matrix[axis];
+			}
+		}
+
+		// false only if the box is entirely outside one of the planes
+		// (can be true for some boxes just outside a corner, which is fine)
+		bool intersects(const vec3& min, const vec3& max) const {
+			for(int i = 0; i < 6; i++) {
+				const vec4& plane = planes[i];
+				// corner furthest along the plane's normal
+				vec4 corner(plane.x >= 0 ? max.x : min.x,
+						plane.y >= 0 ? max.y : min.y,
+						plane.z >= 0 ? max.z : min.z, 1);
+				if(dot(plane, corner) < 0) {
+					return false;
+				}
+			}
+			return true;
+		}
+};
+
+// box around a box after transforming it by model
+inline void transformBounds(const mat4& model, const vec3& min, const vec3& max,
+		vec3& outMin, vec3& outMax) {
+	for(int i = 0; i < 8; i++) {
+		vec4 corner(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z, 1);
+		corner = model * corner;
+		vec3 point(corner.x, corner.y, corner.z);
+		if(i == 0) {
+			outMin = outMax = point;
+		}
+		for(int axis = 0; axis < 3; axis++) {
+			outMin[axis] = std::min(outMin[axis], point[axis]);
+			outMax[axis] = std::max(outMax[axis], point[axis]);
+		}
+	}
+}
+
+// decides which world space boxes are worth drawing this frame
+// with shadows on, a box also counts as visible when its shadow is
+class Culler {
+	private:
+		ViewFrustum view;
+		ViewFrustum shadowView; // planes pulled back through the shadow projection
+		bool shadows;
+		bool enabled;
+		vec3 eye;
+		float pixelScale; // pixels covered by one unit one unit away from the eye
+		static constexpr float minBranchPixels = 0.5;
+
+		bool inView(const vec3& min, const vec3& max) {
+			return view.intersects(min, max) || (shadows && shadowView.intersects(min, max));
+		}
+
+		// true if the box's diagonal would cover less than minBranchPixels
+		bool isTooSmall(const vec3& min, const vec3& max) {
+			float size = length(max - min);
+			float distance = length((min + max) / 2 - eye) - size / 2;
+			return distance > 0 && size / distance * pixelScale < minBranchPixels;
+		}
+
+	public:
+		Culler() {
+			shadows = false;
+			enabled = true;
+			eye = vec3(0, 0, 0);
+			pixelScale = 0;
+		}
+
+		// set up for a frame drawn with viewProjection from eye, and shadow
+		// projection if shadows are on
+		void update(const mat4& viewProjection, const mat4& shadow, bool shadows,
+				const vec3& eye, float pixelScale) {
+			view.setMatrix(viewProjection);
+			shadowView.setMatrix(viewProjection * shadow);
+			this->shadows = shadows;
+			this->eye = eye;
+			this->pixelScale = pixelScale;
+		}
+
+		bool hasShadows() const {
+			return shadows;
+		}
+
+		bool isVisible(const vec3& min, const vec3& max) {
+			bool visible = !enabled || inView(min, max);
+			if(visible) {
+				renderStats.objectsVisible++;
+			} else {
+				renderStats.objectsCulled++;
+			}
+			return visible;
+		}
+
+		// box is in the model space of model
+		bool isVisible(const mat4& model, const vec3& min, const vec3& max) {
+			vec3 worldMin, worldMax;
+			transformBounds(model, min, max, worldMin, worldMax);
+			return isVisible(worldMin, worldMax);
+		}
+
+		// same for one branch of a tree whose box is already known to be
+		// visible, branches too small to cover a pixel are skipped as well
+		bool isBranchVisible(const vec3& min, const vec3& max) {
+			bool visible = !enabled || (inView(min, max) && !isTooSmall(min, max));
+			if(!visible) {
+				renderStats.branchesCulled++;
+			}
+			return visible;
+		}
+
+		void toggle() {
+			enabled = !enabled;
+			cout << "frustum culling " << (enabled ? "on" : "off") << endl;
+		}
+};
+
+#endif
@@ -3,11 +3,17 @@
 #define __LSYSTEM_H_
 
 #include <string>
+#include <sstream>
 #include <map>
+#include <algorithm>
+#include <climits>
 #include <stdexcept>
 #include <stack>
+#include <vector>
 
 #include "Angel.h"
+#include "Parallel.hpp"
+#include "TurtleRope.hpp"
 
 using std::string;
 using std::map;
@@ -16,6 +22,8 @@ using std::runtime_error;
 using std::cout;
 using std::endl;
 using std::stack;
+using std::stringstream;
+using std::vector;
 
 // contains basic drawing parameters
 // modifies a given transform matrix stack according to commands
@@ -91,43 +99,140 @@ class LSystem {
 		map<char, char> replacements;
 		map<char, string> grammar;
 		string turtleString;
+		unsigned derivationThreads;
+		unsigned long long memoryBudget; // most bytes getTurtleString may use
+		unsigned long long segmentBytes; // bytes each F takes once baked, 0 if not counted
+		TurtleRope rope;
+		int ropeIterations; // iterations rope was built for, -1 if not built
+		vector<string> rules; // what each char becomes in one iteration
+		vector<string> reps; // what each char becomes after the last iteration
+		vector<bool> expands; // true if a char's rule changes it
 
-		// apply rules to turtleString one time
-		void iterateTurtleString() {
-			string nextTurtle = "";
-			for(string::iterator it = turtleString.begin(); it != turtleString.end(); ++it) {
-				char currentChar = *it;
-				map<char, string>::iterator rule = grammar.find(currentChar);
-				if(rule != grammar.end()) {
-					// if there is a rule for this character, replace with rhs
-					nextTurtle += rule->second;
-				} else {
-					// no rule, char is same in newTurtle
-					nextTurtle += currentChar;
+		// strings shorter than this are rewritten on the calling thread only
+		static const size_t minParallelLength = 1 << 16;
+		static const unsigned long long defaultMemoryBudget = 1ULL << 30;
+
+		// one entry per possible char, describing what that char becomes
+		void buildTables() {
+			rules.resize(256);
+			reps.resize(256);
+			expands.resize(256);
+			for(unsigned c = 0; c < 256; c++) {
+				rules[c] = reps[c] = string(1, (char)c);
+			}
+			for(map<char, string>::iterator it = grammar.begin(); it != grammar.end(); ++it) {
+				rules[(unsigned char)it->first] = it->second;
+			}
+			for(map<char, char>::iterator it = replacements.begin(); it != replacements.end(); ++it) {
+				// space means just remove character from string
+				reps[(unsigned char)it->first] = it->second == ' ' ? string() : string(1, it->second);
+			}
+			for(unsigned c = 0; c < 256; c++) {
+				expands[c] = rules[c] != string(1, (char)c);
+			}
+		}
+
+		// replace every char of input with its entry in table, putting it in output
+		// input is split into chunks, a prefix sum over the chunks' output lengths
+		// sizes the result exactly, then each worker writes its chunk in place
+		void rewrite(const string& input, const vector<string>& table, string& output) {
+			unsigned numChunks = input.size() < minParallelLength ? 1 : derivationThreads;
+			vector<size_t> offsets(numChunks + 1, 0);
+
+			parallelChunks(input.size(), numChunks, [&](unsigned chunk, size_t begin, size_t end) {
+				size_t length = 0;
+				for(size_t i = begin; i < end; i++) {
+					length += table[(unsigned char)input[i]].size();
+				}
+				offsets[chunk + 1] = length;
+			});
+			for(unsigned chunk = 0; chunk < numChunks; chunk++) {
+				offsets[chunk + 1] += offsets[chunk];
+			}
+
+			output.resize(offsets[numChunks]);
+			if(output.empty()) {
+				return;
+			}
+			parallelChunks(input.size(), numChunks, [&](unsigned chunk, size_t begin, size_t end) {
+				char* out = &output[0] + offsets[chunk];
+				for(size_t i = begin; i < end; i++) {
+					const string& rhs = table[(unsigned char)input[i]];
+					rhs.copy(out, rhs.size());
+					out += rhs.size();
+				}
+			});
+		}
+
+		static unsigned long long saturatingAdd(unsigned long long a, unsigned long long b) {
+			return a > ULLONG_MAX - b ? ULLONG_MAX : a + b;
+		}
+
+		static unsigned long long saturatingMultiply(unsigned long long a, unsigned long long b) {
+			return b != 0 && a > ULLONG_MAX / b ? ULLONG_MAX : a * b;
+		}
+
+		// count each char (before replacements) after the given number of
+		// iterations by repeatedly multiplying a count vector by the production
+		// matrix, whose row for a symbol counts the chars in that symbol's rule
+		// optionally records the length of every generation along the way
+		vector<unsigned long long> countSymbols(unsigned iterations,
+				vector<unsigned long long>* generationLengths = NULL) {
+			// only symbols that can ever appear need a row and column
+			vector<int> index(256, -1);
+			vector<unsigned char> alphabet;
+			string seen = start;
+			for(map<char, string>::iterator it = grammar.begin(); it != grammar.end(); ++it) {
+				seen += it->second;
+			}
+			for(string::iterator it = seen.begin(); it != seen.end(); ++it) {
+				unsigned char c = *it;
+				if(index[c] == -1) {
+					index[c] = alphabet.size();
+					alphabet.push_back(c);
 				}
 			}
-			turtleString = nextTurtle;
-		}
-
-		// replace characters in turtleString according to replacements map
-		void applyReplacements() {
-			string repTurtle = "";
-			for(string::iterator it = turtleString.begin(); it != turtleString.end(); ++it) {
-				char currentChar = *it;
-				map<char, char>::iterator rep = replacements.find(currentChar);
-				if(rep != replacements.end()) {
-					// if there is a replacement for this character, replace
-					if(rep->second == ' ') {
-						// just remove character from string
-					} else {
-						repTurtle += rep->second;
+
+			size_t k = alphabet.size();
+			vector<unsigned long long> production(k * k, 0);
+			for(size_t i = 0; i < k; i++) {
+				const string& rhs = rules[alphabet[i]];
+				for(string::const_iterator it = rhs.begin(); it != rhs.end(); ++it) {
+					production[i * k + index[(unsigned char)*it]]++;
+				}
+			}
+
+			vector<unsigned long long> counts(k, 0);
+			for(string::iterator it = start.begin(); it != start.end(); ++it) {
+				counts[index[(unsigned char)*it]]++;
+			}
+			if(generationLengths != NULL) {
+				generationLengths->assign(1, start.size());
+			}
+			for(unsigned n = 0; n < iterations; n++) {
+				vector<unsigned long long> next(k, 0);
+				unsigned long long length = 0;
+				for(size_t i = 0; i < k; i++) {
+					if(counts[i] == 0) {
+						continue;
 					}
-				} else {
-					// no replacement, char is same in repTurtle
-					repTurtle += currentChar;
+					for(size_t j = 0; j < k; j++) {
+						unsigned long long produced = saturatingMultiply(counts[i], production[i * k + j]);
+						next[j] = saturatingAdd(next[j], produced);
+						length = saturatingAdd(length, produced);
+					}
+				}
+				counts.swap(next);
+				if(generationLengths != NULL) {
+					generationLengths->push_back(length);
 				}
 			}
-			turtleString = repTurtle;
+
+			vector<unsigned long long> result(256, 0);
+			for(size_t i = 0; i < k; i++) {
+				result[alphabet[i]] = counts[i];
+			}
+			return result;
 		}
 
 	public:
@@ -140,6 +245,11 @@ class LSystem {
 			turtleString = "";
 			start = "";
 			iterations = 0;
+			derivationThreads = workerCount();
+			memoryBudget = defaultMemoryBudget;
+			segmentBytes = 0;
+			ropeIterations = -1;
+			buildTables();
 		}
 
 		string getName() {
@@ -149,15 +259,24 @@ class LSystem {
 		// add a replacement rule - use space for empty replacements
 		void addReplacement(char target, char replacement) {
 			replacements.insert(pair<char, char>(target, replacement));
+			buildTables();
+			ropeIterations = -1;
 		}
 
 		// add a rule to this lsystem's grammar
 		void addRule(char lhs, string rhs) {
 			grammar.insert(pair<char, string>(lhs, rhs));
+			buildTables();
+			ropeIterations = -1;
+		}
+
+		// number of threads used to expand the turtle string, 1 for serial
+		void setDerivationThreads(unsigned threads) {
+			derivationThreads = threads == 0 ? 1 : threads;
 		}
 
 		// get the generated turtle string
-		string getTurtleString() {
+		const string& getTurtleString() {
 			if(turtleString != "") { // already computed
 				return turtleString;
 			}
@@ -165,21 +284,129 @@ class LSystem {
 				throw runtime_error("Empty start string");
 			}
 
+			unsigned long long bytes = getPredictedBytes(iterations);
+			if(bytes > memoryBudget) {
+				stringstream message;
+				message << "Turtle string for " << name << " needs " << bytes
+					<< " bytes, over the budget of " << memoryBudget;
+				throw runtime_error(message.str());
+			}
+
+			// lengths are known ahead of time, so allocate both buffers once
+			vector<unsigned long long> lengths;
+			countSymbols(iterations, &lengths);
+			size_t longest = *std::max_element(lengths.begin(), lengths.end());
+			string nextTurtle;
+			nextTurtle.reserve(longest);
+			turtleString.reserve(longest);
+
 			turtleString = start;
-			string lastTurtle;
-			unsigned i = 0;
-			while(i < iterations) {
-				lastTurtle = turtleString;
-				iterateTurtleString();
-				if(turtleString == lastTurtle) {
+			for(unsigned i = 0; i < iterations; i++) {
+				rewrite(turtleString, rules, nextTurtle);
+				if(nextTurtle == turtleString) {
 					break; // no longer changing
 				}
-				i++;
+				turtleString.swap(nextTurtle);
 			}
-			applyReplacements();
+
+			rewrite(turtleString, reps, nextTurtle);
+			turtleString.swap(nextTurtle);
 			return turtleString;
 		}
 
+		// exact count of each char in the final turtle string after the given
+		// number of iterations, indexed by unsigned char, without expanding it
+		vector<unsigned long long> getSymbolCounts(unsigned iterations) {
+			vector<unsigned long long> derived = countSymbols(iterations);
+			vector<unsigned long long> counts(256, 0);
+			for(unsigned c = 0; c < 256; c++) {
+				if(!reps[c].empty()) {
+					unsigned char rep = reps[c][0];
+					counts[rep] = saturatingAdd(counts[rep], derived[c]);
+				}
+			}
+			return counts;
+		}
+
+		// how many times symbol appears in the final turtle string
+		// e.g. the number of segments is getSymbolCount('F')
+		unsigned long long getSymbolCount(char symbol) {
+			return getSymbolCounts(iterations)[(unsigned char)symbol];
+		}
+
+		// exact length of the final turtle string after the given iterations
+		unsigned long long getPredictedLength(unsigned iterations) {
+			vector<unsigned long long> counts = getSymbolCounts(iterations);
+			unsigned long long length = 0;
+			for(unsigned c = 0; c < 256; c++) {
+				length = saturatingAdd(length, counts[c]);
+			}
+			return length;
+		}
+
+		// peak memory getTurtleString needs for the given iterations
+		// two generations are alive at once while rewriting
+		unsigned long long getPredictedBytes(unsigned iterations) {
+			vector<unsigned long long> lengths;
+			countSymbols(iterations, &lengths);
+			lengths.push_back(getPredictedLength(iterations));
+			unsigned long long peak = lengths[0];
+			for(size_t i = 1; i < lengths.size(); i++) {
+				peak = std::max(peak, saturatingAdd(lengths[i - 1], lengths[i]));
+			}
+			return peak;
+		}
+
+		// bytes the baked segments take for the given iterations
+		unsigned long long getPredictedBakeBytes(unsigned iterations) {
+			return saturatingMultiply(getSymbolCounts(iterations)[(unsigned char)'F'], segmentBytes);
+		}
+
+		// most bytes getTurtleString, or the baked segments, may use
+		void setMemoryBudget(unsigned long long bytes) {
+			memoryBudget = bytes;
+		}
+
+		unsigned long long getMemoryBudget() {
+			return memoryBudget;
+		}
+
+		// bytes each segment takes once baked, counted by clampIterations
+		void setSegmentBytes(unsigned long long bytes) {
+			segmentBytes = bytes;
+		}
+
+		// true if getTurtleString fits in the memory budget
+		bool canExpand() {
+			return getPredictedBytes(iterations) <= memoryBudget;
+		}
+
+		// lower iterations until expanding, and baking the segments, fit in
+		// the memory budget
+		// returns true if iterations had to be lowered
+		bool clampIterations() {
+			bool clamped = false;
+			while(iterations > 0 && (getPredictedBytes(iterations) > memoryBudget
+					|| getPredictedBakeBytes(iterations) > memoryBudget)) {
+				iterations--;
+				clamped = true;
+			}
+			return clamped;
+		}
+
+		// get the generated turtle string as a rope of shared subtrees
+		// built once per iteration count, iterate it with begin()
+		const TurtleRope& getTurtleRope() {
+			if(start == "") {
+				throw runtime_error("Empty start string");
+			}
+			if(ropeIterations != (int)iterations) {
+				rope.build(start, iterations, rules, reps, expands);
+				ropeIterations = iterations;
+			}
+			return rope;
+		}
+
 		Turtle* getTurtleCopy() {
 			return new Turtle(protoTurtle);
 		}
@@ -200,6 +427,8 @@ class LSystem {
 				cout << i->first << " -> " << i->second << ", ";
 			}
 			cout << "), " << endl <<
+				"length=" << getPredictedLength(iterations) << ", " << endl <<
+				"segments=" << getSymbolCount('F') << ", " << endl <<
 				"turtleString=" << getTurtleString() << endl;
 		}
 
@@ -7,7 +7,7 @@
 
 #include "textfile.cpp"
 #include "LSystem.hpp"
-#include "PLYReader.hpp"
+#include "ReaderException.hpp"
 
 using std::string;
 using std::stringstream;
@@ -22,7 +22,7 @@ class LSystemReader {
 		ReaderState state;
 
 		void parseLine(string line) {
-			if(PLYReader::startsWith(line, "#")) {
+			if(line.compare(0, 1, "#") == 0) {
 				return; // comment
 			}
 
@@ -6,21 +6,139 @@
 #include <stdlib.h>
 
 #include "LSystem.hpp"
-#include "PLYReader.hpp"
+#include "AssetLoader.hpp"
+#include "RenderStats.hpp"
+#include "TreeBatch.hpp"
+#include "Frustum.hpp"
 
 using std::vector;
 
 
+// builds a baked tree's branch hierarchy while its turtle string is
+// walked, from each segment's cylinder and where the brackets are
+// branches with fewer than minSegments segments are folded into their parent
+class BranchBoundsBuilder {
+	private:
+		struct OpenBranch {
+			size_t branch; // index in branches
+			size_t firstSegment;
+			bool empty;
+			vec3 boundsMin, boundsMax;
+		};
+
+		vector<BranchBounds>& branches;
+		vector<OpenBranch> open;
+		vec4 base, tip; // ends of the unit cylinder
+		float pad;
+		size_t minSegments;
+
+		static void grow(OpenBranch& branch, const vec3& min, const vec3& max) {
+			for(int axis = 0; axis < 3; axis++) {
+				branch.boundsMin[axis] = branch.empty ? min[axis] : std::min(branch.boundsMin[axis], min[axis]);
+				branch.boundsMax[axis] = branch.empty ? max[axis] : std::max(branch.boundsMax[axis], max[axis]);
+			}
+			branch.empty = false;
+		}
+
+	public:
+		BranchBoundsBuilder(vector<BranchBounds>& branches, vec4 base, vec4 tip, float thickness,
+				size_t minSegments) : branches(branches) {
+			this->base = base;
+			this->tip = tip;
+			pad = thickness;
+			this->minSegments = minSegments;
+			branches.clear();
+		}
+
+		// a [ with segment as the index of the next segment baked
+		void openBranch(size_t segment) {
+			branches.push_back(BranchBounds());
+			OpenBranch branch;
+			branch.branch = branches.size() - 1;
+			branch.firstSegment = segment;
+			branch.empty = true;
+			open.push_back(branch);
+		}
+
+		void addSegment(const mat4& cylinder) {
+			if(open.empty()) {
+				return; // on the trunk, only the whole tree's box covers it
+			}
+			vec4 ends[2] = {cylinder * base, cylinder * tip};
+			vec3 min, max;
+			for(int axis = 0; axis < 3; axis++) {
+				min[axis] = std::min(ends[0][axis], ends[1][axis]);
+				max[axis] = std::max(ends[0][axis], ends[1][axis]);
+			}
+			grow(open.back(), min, max);
+		}
+
+		// a ] with segment as the index of the next segment baked
+		void closeBranch(size_t segment) {
+			if(open.empty()) {
+				return;
+			}
+			OpenBranch branch = open.back();
+			open.pop_back();
+			if(segment - branch.firstSegment < minSegments) {
+				// anything nested in it was even smaller, so it's the last one
+				branches.resize(branch.branch);
+			} else {
+				BranchBounds& bounds = branches[branch.branch];
+				bounds.firstSegment = branch.firstSegment;
+				bounds.endSegment = segment;
+				bounds.end = branches.size();
+				vec3 pad3(pad, pad, pad);
+				bounds.boundsMin = branch.boundsMin - pad3;
+				bounds.boundsMax = branch.boundsMax + pad3;
+			}
+			if(!branch.empty && !open.empty()) {
+				grow(open.back(), branch.boundsMin, branch.boundsMax);
+			}
+		}
+
+		// close anything left open at the end of the string
+		void finish(size_t segment) {
+			while(!open.empty()) {
+				closeBranch(segment);
+			}
+		}
+};
 
 class LSystemRenderer {
 	private:
-		GLuint program;
+		ShaderProgram* program;
 		vector<LSystem*>& allSystems;
 		vector<LSystem*> systemsToDraw;
 		vector<vec4> colors;
 		vector<vec4> startPoints;
+		vector<BakedTree> baked; // one per system to draw, at its start point
+		static const unsigned long long minParallelSegments = 1 << 14;
+
+		// coarser versions of each baked tree with the deepest branches dropped
+		// lods[i][l - 1] is level l of tree i, level 0 is baked[i] itself
+		vector<vector<BakedTree> > lods;
+		vector<unsigned> lodLevels; // level each tree is currently drawn at
+		bool useLods;
+		vec3 viewer; // camera position that picks the lod levels
+		static const unsigned maxLods = 4;
+		// switch to level l past lodDistance * 2^(l-1) tree sizes away, with a
+		// margin of lodHysteresis either way so trees don't flicker between levels
+		static constexpr float lodDistance = 1.5;
+		static constexpr float lodHysteresis = 0.1;
+		static const size_t minBranchSegments = 256; // smaller ones aren't worth culling
+		vector<std::pair<size_t, size_t> > ranges; // visible segments of the tree being drawn
 		vec4 randomRange[2];
 
+		bool canInstance; // per-instance attributes are supported
+		// every baked tree's model matrices, when instancing is supported
+		// it's packed once this much of its free space is in pieces
+		BufferArena* instanceArena;
+		static constexpr float maxInstanceFragmentation = 0.5;
+		bool instancing;
+		bool batching; // draw all trees from one pre-transformed buffer
+		TreeBatch* batch;
+
 		vector<Mesh*> meshes;
 		Mesh* sphere;
 		GLsizeiptr sphereLength;
@@ -28,8 +146,9 @@ class LSystemRenderer {
 		GLsizeiptr cylinderLength;
 
 
-		// draw a component of a turtle (sphere or cylinder)
-		void drawTurtleComponent(Turtle* turtle, Mesh* comp) {
+		// transform that fits a component (sphere or cylinder) to the turtle,
+		// applied after the turtle's current transform
+		mat4 componentTransform(Turtle* turtle, Mesh* comp) {
 			bool isCylinder = comp == cylinder;
 			vec3 size = comp->getBoundingBox()->getSize();
 
@@ -48,12 +167,61 @@ class LSystemRenderer {
 			}
 			mat4 trans = Translate(dest - center);
 
-			mat4 finalModel = turtle->ctm->top() * scale * trans;
-			GLuint modelLoc = glGetUniformLocationARB(program, "model_matrix");
-			glUniformMatrix4fv(modelLoc, 1, GL_TRUE, finalModel);
+			return scale * trans;
+		}
+
+		// queue baked instances [begin, end) of a component, copies times each
+		// (the second copy is the shadow)
+		void drawTurtleComponents(RenderQueue& queue, vector<mat4>& models, size_t begin, size_t end,
+				Mesh* comp, vec4 color, GLsizei copies) {
+			for(vector<mat4>::const_iterator i = models.begin() + begin; i != models.begin() + end; ++i) {
+				DrawItem item(comp, copies);
+				item.color = color;
+				item.model = *i;
+				queue.add(item);
+			}
+		}
+
+		// queue count instances of a component as one draw, reading model
+		// matrices from the tree's instance buffer starting at instance first
+		// each matrix is used for copies instances in a row, so shadows come
+		// out of the same call
+		void drawTurtleComponentsInstanced(RenderQueue& queue, BakedTree& tree, size_t first,
+				size_t count, Mesh* comp, vec4 color, GLsizei copies) {
+			if(count == 0) {
+				return;
+			}
+			DrawItem item(comp, count * copies);
+			item.color = color;
+			item.instanceBuffer = instanceArena->getBuffer();
+			item.instanceOffset = tree.instances->offset + first * sizeof(mat4);
+			item.divisor = copies;
+			queue.add(item);
+		}
+
+		// copy a tree's matrices into the instance arena, replacing the
+		// tree's old ones
+		void uploadInstances(BakedTree& tree) {
+			if(!canInstance) {
+				return;
+			}
+			releaseInstances(tree);
+			GLsizeiptr sphereBytes = tree.spheres.size() * sizeof(mat4);
+			GLsizeiptr cylinderBytes = tree.cylinders.size() * sizeof(mat4);
+			tree.instances = instanceArena->allocate(sphereBytes + cylinderBytes);
+			if(sphereBytes > 0) {
+				instanceArena->upload(tree.instances, &tree.spheres[0], sphereBytes);
+			}
+			if(cylinderBytes > 0) {
+				instanceArena->upload(tree.instances, &tree.cylinders[0], cylinderBytes, sphereBytes);
+			}
+		}
 
-			// draw the component
-			glDrawArrays(GL_TRIANGLES, comp->getDrawOffset(), comp->getNumPoints());
+		void releaseInstances(BakedTree& tree) {
+			if(instanceArena != NULL) {
+				instanceArena->release(tree.instances);
+			}
+			tree.instances = NULL;
 		}
 
 		vec4 randomColor() {
@@ -75,87 +243,512 @@ class LSystemRenderer {
 			return point;
 		}
 
-		// draw the given lsystem starting at the given position
-		void drawSystem(LSystem* sys, vec4 startPoint, vec4 color, bool setColor) {
+		// give one turtle string command to the turtle
+		void interpret(Turtle* turtle, char command) {
+			switch(command) {
+				case 'F':
+				case 'f':
+					turtle->forward();
+					break;
+				case '+':
+					turtle->rotate(Turtle::X, true);
+					break;
+				case '-':
+					turtle->rotate(Turtle::X, false);
+					break;
+				case '&':
+					turtle->rotate(Turtle::Y, true);
+					break;
+				case '^':
+					turtle->rotate(Turtle::Y, false);
+					break;
+				case '\\':
+					turtle->rotate(Turtle::Z, true);
+					break;
+				case '/':
+					turtle->rotate(Turtle::Z, false);
+					break;
+				case '|':
+					turtle->turnAround();
+					break;
+				case '[':
+					turtle->push();
+					break;
+				case ']':
+					turtle->pop();
+					break;
+			}
+		}
+
+		// run the turtle over the given lsystem starting at the given position,
+		// recording the final model matrix of every sphere and cylinder
+		void bakeSystem(LSystem* sys, vec4 startPoint, BakedTree& baked) {
 			Turtle* turtle = sys->getTurtleCopy();
 			stack<mat4> modelView;
 			// move to start point and point the tree upwards
 			modelView.push(Translate(startPoint) * RotateX(-90));
 			turtle->ctm = &modelView;
-			string turtleString = sys->getTurtleString();
+			mat4 sphereTransform = componentTransform(turtle, sphere);
+			mat4 cylinderTransform = componentTransform(turtle, cylinder);
+
+			// every F makes one of each, so the arrays can be sized up front
+			unsigned long long segments = sys->getSymbolCount('F');
+			baked.spheres.clear();
+			baked.cylinders.clear();
+			baked.depths.clear();
+			baked.spheres.reserve(segments);
+			baked.cylinders.reserve(segments);
+			baked.depths.reserve(segments);
+
+			// walk the shared-subtree rope rather than copying the whole string
+			TurtleRope::Iterator symbols = sys->getTurtleRope().begin();
+			char currentChar;
+			unsigned depth = 0;
+			vec4 base, tip;
+			cylinderEnds(base, tip);
+			BranchBoundsBuilder branches(baked.branches, base, tip, turtle->thickness,
+					minBranchSegments);
+			while(symbols.next(currentChar)) {
+				if(currentChar == 'F') {
+					baked.spheres.push_back(modelView.top() * sphereTransform);
+					baked.cylinders.push_back(modelView.top() * cylinderTransform);
+					baked.depths.push_back(std::min(depth, 255u));
+					branches.addSegment(baked.cylinders.back());
+				} else if(currentChar == '[') {
+					depth++;
+					branches.openBranch(baked.cylinders.size());
+				} else if(currentChar == ']') {
+					depth--;
+					branches.closeBranch(baked.cylinders.size());
+				}
+				interpret(turtle, currentChar);
+			}
+			branches.finish(baked.cylinders.size());
+
+			computeBounds(baked, turtle->thickness);
+			delete turtle;
+		}
+
+		// centers of the unit cylinder's end caps, a segment's cylinder
+		// matrix moves them to where the segment starts and ends
+		void cylinderEnds(vec4& base, vec4& tip) {
+			BoundingBox* box = cylinder->getBoundingBox();
+			vec4 center = box->getCenter();
+			base = vec4(center.x, center.y, box->getMin().z, 1);
+			tip = vec4(center.x, center.y, box->getMax().z, 1);
+		}
+
+		// fit the tree's box around both ends of every segment, padded by
+		// the thickness of the components
+		void computeBounds(BakedTree& tree, float thickness) {
+			vec4 base, tip;
+			cylinderEnds(base, tip);
+			vec3 pad(thickness, thickness, thickness);
+			if(tree.cylinders.empty()) {
+				tree.boundsMin = tree.boundsMax = vec3(0, 0, 0);
+				return;
+			}
+			vec4 first = tree.cylinders[0] * base;
+			tree.boundsMin = tree.boundsMax = vec3(first.x, first.y, first.z);
+			for(vector<mat4>::const_iterator i = tree.cylinders.begin(); i != tree.cylinders.end(); ++i) {
+				vec4 ends[2] = {(*i) * base, (*i) * tip};
+				for(int e = 0; e < 2; e++) {
+					for(int axis = 0; axis < 3; axis++) {
+						tree.boundsMin[axis] = std::min(tree.boundsMin[axis], ends[e][axis]);
+						tree.boundsMax[axis] = std::max(tree.boundsMax[axis], ends[e][axis]);
+					}
+				}
+			}
+			tree.boundsMin -= pad;
+			tree.boundsMax += pad;
+		}
 
-			if(setColor) {
-				GLuint colorLoc = glGetUniformLocationARB(program, "inColor");
-				glUniform4fv(colorLoc, 1, color);
+		// copy of tree with only the segments at most maxDepth brackets deep
+		// branches keep their boxes, with their segments renumbered
+		void buildLod(BakedTree& tree, unsigned maxDepth, BakedTree& lod) {
+			vector<size_t> kept(tree.depths.size() + 1); // segments kept before each one
+			kept[0] = 0;
+			for(size_t i = 0; i < tree.depths.size(); i++) {
+				if(tree.depths[i] <= maxDepth) {
+					lod.spheres.push_back(tree.spheres[i]);
+					lod.cylinders.push_back(tree.cylinders[i]);
+					lod.depths.push_back(tree.depths[i]);
+				}
+				kept[i + 1] = lod.cylinders.size();
 			}
+			lod.boundsMin = tree.boundsMin;
+			lod.boundsMax = tree.boundsMax;
+			lod.branches = tree.branches;
+			for(vector<BranchBounds>::iterator i = lod.branches.begin(); i != lod.branches.end(); ++i) {
+				i->firstSegment = kept[i->firstSegment];
+				i->endSegment = kept[i->endSegment];
+			}
+		}
 
-			for(string::iterator it = turtleString.begin(); it != turtleString.end(); ++it) {
-				char currentChar = *it;
-				
-				if(currentChar == 'F') {
-					drawTurtleComponent(turtle, sphere);
-					drawTurtleComponent(turtle, cylinder);
-				}
-
-				switch(currentChar) {
-					case 'F':
-					case 'f':
-						turtle->forward();
-						break;
-					case '+':
-						turtle->rotate(Turtle::X, true);
-						break;
-					case '-':
-						turtle->rotate(Turtle::X, false);
-						break;
-					case '&':
-						turtle->rotate(Turtle::Y, true);
-						break;
-					case '^':
-						turtle->rotate(Turtle::Y, false);
-						break;
-					case '\\':
-						turtle->rotate(Turtle::Z, true);
-						break;
-					case '/':
-						turtle->rotate(Turtle::Z, false);
-						break;
-					case '|':
-						turtle->turnAround();
-						break;
-					case '[':
-						turtle->push();
-						break;
-					case ']':
-						turtle->pop();
-						break;
+		// fill ranges with the [begin, end) runs of tree's segments that
+		// aren't in a culled branch
+		// branches are in string order, so culled ones come in order too
+		void findVisibleSegments(BakedTree& tree, Culler& culler) {
+			ranges.clear();
+			size_t next = 0; // first segment not known to be culled
+			for(size_t i = 0; i < tree.branches.size(); ) {
+				const BranchBounds& branch = tree.branches[i];
+				if(branch.firstSegment == branch.endSegment
+						|| culler.isBranchVisible(branch.boundsMin, branch.boundsMax)) {
+					i++; // check what's nested in it
+					continue;
+				}
+				if(branch.firstSegment > next) {
+					ranges.push_back(std::make_pair(next, branch.firstSegment));
+				}
+				next = branch.endSegment;
+				i = branch.end; // skip everything nested in it
+			}
+			if(next < tree.cylinders.size()) {
+				ranges.push_back(std::make_pair(next, tree.cylinders.size()));
+			}
+		}
+
+		// build the lod chain for baked tree index, one level per dropped
+		// bracket depth, up to maxLods levels in all
+		void buildLods(size_t index) {
+			BakedTree& tree = baked[index];
+			for(vector<BakedTree>::iterator i = lods[index].begin(); i != lods[index].end(); ++i) {
+				releaseInstances(*i);
+			}
+			lods[index].clear();
+			unsigned deepest = 0;
+			for(size_t i = 0; i < tree.depths.size(); i++) {
+				deepest = std::max(deepest, (unsigned)tree.depths[i]);
+			}
+			// coarser levels are skipped once they'd go over the memory budget
+			unsigned long long budget = systemsToDraw[index]->getMemoryBudget();
+			unsigned long long used = tree.cylinders.size() * bytesPerSegment;
+			for(unsigned level = 1; level < maxLods && level <= deepest; level++) {
+				unsigned long long kept = 0;
+				for(size_t i = 0; i < tree.depths.size(); i++) {
+					if(tree.depths[i] <= deepest - level) {
+						kept++;
+					}
+				}
+				used += kept * bytesPerSegment;
+				if(used > budget) {
+					break;
 				}
+				lods[index].push_back(BakedTree());
+				buildLod(tree, deepest - level, lods[index].back());
+				uploadInstances(lods[index].back());
 			}
+			lodLevels[index] = 0;
+		}
+
+		// pick the level to draw tree index at for the current viewer
+		void updateLod(size_t index) {
+			if(!useLods) {
+				lodLevels[index] = 0;
+				return;
+			}
+			BakedTree& tree = baked[index];
+			vec3 size = tree.boundsMax - tree.boundsMin;
+			float treeSize = std::max(std::max(size.x, size.y), std::max(size.z, 1.0f));
+			vec3 center = (tree.boundsMin + tree.boundsMax) / 2;
+			float distance = length(viewer - center) / treeSize;
+
+			// level l starts at lodDistance * 2^(l-1)
+			unsigned& level = lodLevels[index];
+			unsigned coarsest = lods[index].size();
+			while(level < coarsest
+					&& distance > lodDistance * (1 << level) * (1 + lodHysteresis)) {
+				level++;
+			}
+			while(level > 0
+					&& distance < lodDistance * (1 << (level - 1)) * (1 - lodHysteresis)) {
+				level--;
+			}
+		}
+
+		// both bakes need every ] to close an earlier [, and every [ closed
+		void checkBrackets(LSystem* sys) {
+			TurtleRope::Iterator symbols = sys->getTurtleRope().begin();
+			char current;
+			unsigned long long depth = 0;
+			while(symbols.next(current)) {
+				if(current == '[') {
+					depth++;
+				} else if(current == ']') {
+					if(depth == 0) {
+						throw runtime_error("Unmatched ] in turtle string of " + sys->getName());
+					}
+					depth--;
+				}
+			}
+			if(depth != 0) {
+				throw runtime_error("Unmatched [ in turtle string of " + sys->getName());
+			}
+		}
+
+		// top level [ ... ] of a turtle string, with what's needed to bake it
+		// on its own: where it starts, the turtle's transform on entry and
+		// where its segments go in the baked arrays
+		struct Branch {
+			size_t open, close;
+			size_t firstSegment, numSegments;
+			mat4 entry;
+		};
+
+		// same as bakeSystem, but interprets the top level branches of the
+		// turtle string on worker threads
+		// a bracket matching pass finds the branches, then a pass over
+		// everything outside them computes each one's entry transform
+		// all of it walks the rope, each branch from its own offset, so the
+		// whole string is never expanded
+		// brackets must already have been checked with checkBrackets
+		void bakeSystemParallel(LSystem* sys, vec4 startPoint, BakedTree& baked) {
+			const TurtleRope& rope = sys->getTurtleRope();
+			unsigned long long length = rope.getLength();
+
+			// find top level branches and count the segments in each
+			vector<Branch> branches;
+			size_t depth = 0;
+			TurtleRope::Iterator symbols = rope.begin();
+			char current;
+			for(size_t i = 0; symbols.next(current); i++) {
+				if(current == '[') {
+					if(depth == 0) {
+						Branch branch;
+						branch.open = i;
+						branch.numSegments = 0;
+						branches.push_back(branch);
+					}
+					depth++;
+				} else if(current == ']') {
+					depth--;
+					if(depth == 0) {
+						branches.back().close = i;
+					}
+				} else if(current == 'F' && depth > 0) {
+					branches.back().numSegments++;
+				}
+			}
+
+			Turtle* turtle = sys->getTurtleCopy();
+			stack<mat4> modelView;
+			modelView.push(Translate(startPoint) * RotateX(-90));
+			turtle->ctm = &modelView;
+			mat4 sphereTransform = componentTransform(turtle, sphere);
+			mat4 cylinderTransform = componentTransform(turtle, cylinder);
+
+			unsigned long long segments = sys->getSymbolCount('F');
+			baked.spheres.resize(segments);
+			baked.cylinders.resize(segments);
+			baked.depths.resize(segments);
+
+			// walk the trunk, skipping over branches but noting their entry
+			// transform and where their segments start, in string order
+			size_t nextSegment = 0;
+			vector<Branch>::iterator nextBranch = branches.begin();
+			symbols = rope.begin();
+			for(size_t i = 0; i < length; i++) {
+				if(nextBranch != branches.end() && i == nextBranch->open) {
+					nextBranch->entry = modelView.top();
+					nextBranch->firstSegment = nextSegment;
+					nextSegment += nextBranch->numSegments;
+					i = nextBranch->close;
+					symbols = rope.at(i + 1);
+					++nextBranch;
+					continue;
+				}
+				symbols.next(current);
+				if(current == 'F') {
+					baked.spheres[nextSegment] = modelView.top() * sphereTransform;
+					baked.cylinders[nextSegment] = modelView.top() * cylinderTransform;
+					baked.depths[nextSegment] = 0;
+					nextSegment++;
+				}
+				interpret(turtle, current);
+			}
+
+			// branches are independent once their entry transform is known
+			parallelFor(branches.size(), workerCount(), [&](size_t index) {
+				const Branch& branch = branches[index];
+				Turtle* branchTurtle = sys->getTurtleCopy();
+				stack<mat4> branchView;
+				branchView.push(branch.entry);
+				branchTurtle->ctm = &branchView;
+				size_t segment = branch.firstSegment;
+				unsigned depth = 1;
+				TurtleRope::Iterator branchSymbols = rope.at(branch.open + 1);
+				char symbol;
+				for(size_t i = branch.open + 1; i < branch.close; i++) {
+					branchSymbols.next(symbol);
+					if(symbol == 'F') {
+						baked.spheres[segment] = branchView.top() * sphereTransform;
+						baked.cylinders[segment] = branchView.top() * cylinderTransform;
+						baked.depths[segment] = std::min(depth, 255u);
+						segment++;
+					} else if(symbol == '[') {
+						depth++;
+					} else if(symbol == ']') {
+						depth--;
+					}
+					interpret(branchTurtle, symbol);
+				}
+				delete branchTurtle;
+			});
+
+			// the matrices are all known now, so the bracket pass can be
+			// repeated to find each branch's bounds
+			vec4 base, tip;
+			cylinderEnds(base, tip);
+			BranchBoundsBuilder bounds(baked.branches, base, tip, turtle->thickness,
+					minBranchSegments);
+			size_t segment = 0;
+			symbols = rope.begin();
+			while(symbols.next(current)) {
+				if(current == 'F') {
+					bounds.addSegment(baked.cylinders[segment]);
+					segment++;
+				} else if(current == '[') {
+					bounds.openBranch(segment);
+				} else if(current == ']') {
+					bounds.closeBranch(segment);
+				}
+			}
+			bounds.finish(segment);
 
+			computeBounds(baked, turtle->thickness);
 			delete turtle;
+		}
+
+		// bake every system being shown at its start point
+		void bakeSystems() {
+			for(size_t i = systemsToDraw.size(); i < baked.size(); i++) {
+				releaseInstances(baked[i]);
+				for(vector<BakedTree>::iterator lod = lods[i].begin(); lod != lods[i].end(); ++lod) {
+					releaseInstances(*lod);
+				}
+			}
+			baked.resize(systemsToDraw.size());
+			lods.resize(systemsToDraw.size());
+			lodLevels.resize(systemsToDraw.size());
+			for (vector<LSystem*>::const_iterator i = systemsToDraw.begin(); i != systemsToDraw.end(); ++i) {
+				int index = i - systemsToDraw.begin();
+				// only worth the threads for big trees
+				LSystem* sys = *i;
+				checkBrackets(sys);
+				if(workerCount() > 1 && sys->getSymbolCount('F') >= minParallelSegments) {
+					bakeSystemParallel(sys, startPoints[index], baked[index]);
+				} else {
+					bakeSystem(sys, startPoints[index], baked[index]);
+				}
+				uploadInstances(baked[index]);
+				buildLods(index);
+			}
+			// instance offsets are read when drawing, so nothing needs fixing up
+			if(instanceArena != NULL && instanceArena->getFragmentation() > maxInstanceFragmentation) {
+				instanceArena->defragment();
+			}
+			if(batching) {
+				batch->rebuild(baked, colors);
+			}
+		}
 
+		// queue the branches of a baked system that the culler can see,
+		// doesn't depend on the turtle string at all
+		void drawSystem(RenderQueue& queue, BakedTree& tree, vec4 color, GLsizei copies,
+				Culler& culler) {
+			findVisibleSegments(tree, culler);
+			vector<std::pair<size_t, size_t> >::const_iterator range;
+			if(instancing) {
+				for(range = ranges.begin(); range != ranges.end(); ++range) {
+					drawTurtleComponentsInstanced(queue, tree, range->first,
+							range->second - range->first, sphere, color, copies);
+				}
+				for(range = ranges.begin(); range != ranges.end(); ++range) {
+					drawTurtleComponentsInstanced(queue, tree, tree.spheres.size() + range->first,
+							range->second - range->first, cylinder, color, copies);
+				}
+			} else {
+				for(range = ranges.begin(); range != ranges.end(); ++range) {
+					drawTurtleComponents(queue, tree.spheres, range->first, range->second,
+							sphere, color, copies);
+				}
+				for(range = ranges.begin(); range != ranges.end(); ++range) {
+					drawTurtleComponents(queue, tree.cylinders, range->first, range->second,
+							cylinder, color, copies);
+				}
+			}
 		}
 
 	public:
-		LSystemRenderer(GLuint program, vector<LSystem*>& allSystems)
+		// memory each baked segment takes: its sphere and cylinder matrices
+		// and depth, and their copy in the instance arena
+		static const unsigned long long bytesPerSegment = 4 * sizeof(mat4) + sizeof(unsigned char);
+
+		LSystemRenderer(ShaderProgram* program, vector<LSystem*>& allSystems)
 				: allSystems(allSystems) {
 			this->program = program;
+			// without GL, trees are drawn a component at a time
+			canInstance = !program->isSoftware()
+				&& (GLEW_VERSION_3_3 || GLEW_ARB_instanced_arrays);
+			instancing = canInstance;
+			instanceArena = canInstance ? new BufferArena() : NULL;
 			
-			PLYReader sphereReader("meshes/sphere.ply");
-			sphere = sphereReader.read();
-			PLYReader cylinderReader("meshes/cylinder.ply");
-			cylinder = cylinderReader.read();
+			// needed straight away to bake the trees
+			startLoading();
+			sphere = assetLoader.takeMesh("meshes/sphere.ply").get();
+			sphere->setLayout(VertexLayout(VertexLayout::POSITION_SHORT3));
+			cylinder = assetLoader.takeMesh("meshes/cylinder.ply").get();
+			cylinder->setLayout(VertexLayout(VertexLayout::POSITION_SHORT3));
 			meshes.push_back(cylinder);
 			meshes.push_back(sphere);
+
+			batching = false;
+			batch = program->isSoftware() ? NULL : new TreeBatch(program, sphere, cylinder);
+			useLods = true;
+			viewer = vec3(0, 0, 0);
 			
 			showOneSystem(0);
 		}
 
-		void display(bool setColor = true) {
-			vec4 startPoint(0, 0, 0, 1);
-			for (vector<LSystem*>::const_iterator i = systemsToDraw.begin(); i != systemsToDraw.end(); ++i) {
-				int index = i - systemsToDraw.begin();
-				drawSystem(*i, startPoints[index], colors[index], setColor);
+		// start reading the meshes trees are drawn with
+		static void startLoading() {
+			assetLoader.loadMesh("meshes/sphere.ply");
+			assetLoader.loadMesh("meshes/cylinder.ply");
+		}
+
+		// queue every tree the culler can see, and its shadow in the same
+		// draws if shadows are on
+		void display(RenderQueue& queue, Culler& culler) {
+			GLsizei copies = culler.hasShadows() ? 2 : 1;
+			if(batching) {
+				batch->update();
+				if(batch->isReady()) {
+					// all or nothing, so only skipped if every tree is out of view
+					vec3 boundsMin, boundsMax;
+					for(size_t index = 0; index < baked.size(); index++) {
+						for(int axis = 0; axis < 3; axis++) {
+							boundsMin[axis] = index == 0 ? baked[index].boundsMin[axis]
+								: std::min(boundsMin[axis], baked[index].boundsMin[axis]);
+							boundsMax[axis] = index == 0 ? baked[index].boundsMax[axis]
+								: std::max(boundsMax[axis], baked[index].boundsMax[axis]);
+						}
+					}
+					if(!baked.empty() && culler.isVisible(boundsMin, boundsMax)) {
+						batch->draw(queue, copies);
+					}
+					return;
+				}
+				// still building, draw the trees one by one meanwhile
+			}
+			for (size_t index = 0; index < baked.size(); index++) {
+				if(!culler.isVisible(baked[index].boundsMin, baked[index].boundsMax)) {
+					continue;
+				}
+				updateLod(index);
+				unsigned level = lodLevels[index];
+				BakedTree& tree = level == 0 ? baked[index] : lods[index][level - 1];
+				drawSystem(queue, tree, colors[index], copies, culler);
 			}
 		}
 
@@ -166,6 +759,7 @@ class LSystemRenderer {
 			startPoints.push_back(vec4(0, 0, 0, 1));
 			colors.clear();
 			colors.push_back(randomColor());
+			bakeSystems();
 		}
 
 		// show all systems randomly within the volume set previously
@@ -178,6 +772,7 @@ class LSystemRenderer {
 				startPoints.push_back(randomPoint());
 				colors.push_back(randomColor());
 			}
+			bakeSystems();
 		}
 
 		// show all systems randomly within the given volume
@@ -187,6 +782,42 @@ class LSystemRenderer {
 			showAllSystemsRandomly();
 		}
 
+		// switch between one draw call per component and one per mesh per tree
+		void toggleInstancing() {
+			instancing = canInstance && !instancing;
+			cout << "instanced trees " << (instancing ? "on" : "off") << endl;
+		}
+
+		// lod levels are picked by distance from this position
+		void setViewer(vec3 eye) {
+			viewer = eye;
+		}
+
+		// switch between distance based lod and always drawing full detail
+		void toggleLods() {
+			useLods = !useLods;
+			cout << "tree lod " << (useLods ? "on" : "off") << endl;
+		}
+
+		// switch to drawing every tree with one draw call from a static batch
+		void toggleBatching() {
+			batching = batch != NULL && !batching;
+			if(batching) {
+				batch->rebuild(baked, colors);
+			}
+			cout << "static tree batch " << (batching ? "on" : "off") << endl;
+		}
+
+		// upload the static batch if it finished building, returns true if it did
+		bool updateBatch() {
+			return batching && batch->update();
+		}
+
+		// true while the static batch is being rebuilt in the background
+		bool batchPending() {
+			return batching && batch->isPending();
+		}
+
 		bool forestMode() {
 			return systemsToDraw.size() > 1;
 		}
@@ -0,0 +1,89 @@
+#ifndef __MAPPEDFILE_H_
+#define __MAPPEDFILE_H_
+
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "ReaderException.hpp"
+
+using std::string;
+
+// all of a file's bytes, read only
+// mapped straight from the page cache where there's mmap, so nothing is
+// copied until it's used, and read into memory otherwise
+// the bytes aren't null terminated
+class MappedFile {
+	private:
+		char* bytes;
+		size_t size;
+		bool mapped;
+
+	public:
+		MappedFile(const char* filename) {
+			bytes = NULL;
+			size = 0;
+			mapped = false;
+#ifndef _WIN32
+			int fd = open(filename, O_RDONLY);
+			struct stat info;
+			if(fd < 0 || fstat(fd, &info) != 0) {
+				if(fd >= 0) {
+					close(fd);
+				}
+				throw ReaderException(string("Can't read ") + filename);
+			}
+			size = info.st_size;
+			if(size > 0) {
+				void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if(map != MAP_FAILED) {
+					bytes = (char*)map;
+					mapped = true;
+					madvise(map, size, MADV_SEQUENTIAL);
+				}
+			}
+			close(fd);
+			if(mapped || size == 0) {
+				return;
+			}
+#endif
+			// binary mode, so Windows leaves line ends alone
+			FILE* file = fopen(filename, "rb");
+			if(file == NULL) {
+				throw ReaderException(string("Can't read ") + filename);
+			}
+			fseek(file, 0, SEEK_END);
+			size = ftell(file);
+			rewind(file);
+			bytes = (char*)malloc(size > 0 ? size : 1);
+			size = fread(bytes, 1, size, file);
+			fclose(file);
+		}
+
+		~MappedFile() {
+#ifndef _WIN32
+			if(mapped) {
+				munmap(bytes, size);
+				return;
+			}
+#endif
+			free(bytes);
+		}
+
+		const char* getBytes() {
+			return bytes;
+		}
+
+		size_t getSize() {
+			return size;
+		}
+};
+
+#endif
@@ -3,9 +3,15 @@
 #define __MESH_H_
 
 #include "Angel.h"
+#include "VertexLayout.hpp"
 #include <algorithm>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <string.h>
 
 using std::string;
+using std::vector;
 using std::cout;
 using std::endl;
 
@@ -26,6 +32,7 @@ class BoundingBox {
 			for(int i = 0; i < 3; i++) {
 				max[i] = min[i] = initialPoint[i];
 			}
+			dirty = true;
 		}
 
 		void addContainedVertex(vec4 vert) {
@@ -109,14 +116,159 @@ class BoundingBox {
 		}
 };
 
+// reorder triangles (three indices each) so vertices they share are
+// likely still in the GPU's post-transform cache, using Tom Forsyth's
+// "linear-speed vertex cache optimisation"
+// each step picks the triangle whose vertices score highest, a vertex scores
+// well if it's recently used or has few triangles left to draw
+class VertexCacheOptimizer {
+	private:
+		static const int cacheSize = 32;
+
+		struct Vertex {
+			int cachePosition; // -1 if not in the cache
+			float score;
+			unsigned firstTriangle; // into triangleList
+			unsigned numTriangles;
+			unsigned trianglesLeft; // not drawn yet
+		};
+
+		static float vertexScore(const Vertex& vertex) {
+			if(vertex.trianglesLeft == 0) {
+				return -1;
+			}
+			float score = 0;
+			if(vertex.cachePosition >= 0) {
+				if(vertex.cachePosition < 3) {
+					score = 0.75; // just used, same score for the whole last triangle
+				} else {
+					float scale = 1.0 / (cacheSize - 3);
+					score = pow(1 - (vertex.cachePosition - 3) * scale, 1.5f);
+				}
+			}
+			// fewer triangles left gets a boost, so lone ones aren't left behind
+			return score + 2 * pow((float)vertex.trianglesLeft, -0.5f);
+		}
+
+	public:
+		static void reorder(vector<GLuint>& indices, unsigned numVertices) {
+			size_t numTriangles = indices.size() / 3;
+			vector<Vertex> vertices(numVertices);
+			for(unsigned i = 0; i < numVertices; i++) {
+				vertices[i].cachePosition = -1;
+				vertices[i].numTriangles = 0;
+			}
+			for(size_t i = 0; i < indices.size(); i++) {
+				vertices[indices[i]].numTriangles++;
+			}
+			// triangles using each vertex, grouped by vertex
+			unsigned start = 0;
+			for(unsigned i = 0; i < numVertices; i++) {
+				vertices[i].firstTriangle = start;
+				start += vertices[i].numTriangles;
+				vertices[i].trianglesLeft = 0;
+			}
+			vector<unsigned> triangleList(indices.size());
+			for(size_t i = 0; i < indices.size(); i++) {
+				Vertex& vertex = vertices[indices[i]];
+				triangleList[vertex.firstTriangle + vertex.trianglesLeft++] = i / 3;
+			}
+			for(unsigned i = 0; i < numVertices; i++) {
+				vertices[i].score = vertexScore(vertices[i]);
+			}
+			vector<bool> drawn(numTriangles, false);
+
+			vector<GLuint> ordered;
+			ordered.reserve(indices.size());
+			vector<GLuint> cache; // most recent first
+			size_t nextUndrawn = 0; // for when nothing in the cache is left to draw
+			long best = -1;
+			while(ordered.size() < indices.size()) {
+				if(best < 0) {
+					// start over from the first triangle not drawn yet
+					while(drawn[nextUndrawn]) {
+						nextUndrawn++;
+					}
+					best = nextUndrawn;
+				}
+				drawn[best] = true;
+				vector<GLuint> newCache;
+				for(int corner = 0; corner < 3; corner++) {
+					GLuint index = indices[best * 3 + corner];
+					ordered.push_back(index);
+					newCache.push_back(index);
+					// this triangle isn't left to draw for the vertex any more
+					Vertex& vertex = vertices[index];
+					unsigned* list = &triangleList[vertex.firstTriangle];
+					for(unsigned i = 0; i < vertex.trianglesLeft; i++) {
+						if(list[i] == (unsigned)best) {
+							list[i] = list[--vertex.trianglesLeft];
+							break;
+						}
+					}
+				}
+				for(vector<GLuint>::iterator i = cache.begin(); i != cache.end(); ++i) {
+					if(std::find(newCache.begin(), newCache.end(), *i) == newCache.end()) {
+						newCache.push_back(*i);
+					}
+				}
+				// rescore everything that was or is in the cache
+				for(size_t i = 0; i < newCache.size(); i++) {
+					Vertex& vertex = vertices[newCache[i]];
+					vertex.cachePosition = i < (size_t)cacheSize ? (int)i : -1;
+					vertex.score = vertexScore(vertex);
+				}
+				newCache.resize(std::min(newCache.size(), (size_t)cacheSize));
+				cache.swap(newCache);
+
+				// next is the best undrawn triangle touching the cache
+				best = -1;
+				float bestScore = -1;
+				for(vector<GLuint>::iterator i = cache.begin(); i != cache.end(); ++i) {
+					Vertex& vertex = vertices[*i];
+					for(unsigned t = 0; t < vertex.trianglesLeft; t++) {
+						unsigned triangle = triangleList[vertex.firstTriangle + t];
+						float score = vertices[indices[triangle * 3]].score
+							+ vertices[indices[triangle * 3 + 1]].score
+							+ vertices[indices[triangle * 3 + 2]].score;
+						if(score > bestScore) {
+							bestScore = score;
+							best = triangle;
+						}
+					}
+				}
+			}
+			indices.swap(ordered);
+		}
+
+		// vertices a FIFO cache the size reorder plans for would have to
+		// transform per triangle, 0.5 is the best a regular grid can do
+		static float missRatio(const vector<GLuint>& indices) {
+			vector<GLuint> cache;
+			unsigned misses = 0;
+			for(size_t i = 0; i < indices.size(); i++) {
+				if(std::find(cache.begin(), cache.end(), indices[i]) == cache.end()) {
+					misses++;
+					cache.insert(cache.begin(), indices[i]);
+					if(cache.size() > (size_t)cacheSize) {
+						cache.pop_back();
+					}
+				}
+			}
+			return indices.empty() ? 0 : (float)misses / (indices.size() / 3);
+		}
+};
+
 // holds vertex list and point data to be sent to GPU
 class Mesh {
+	friend class MeshCache; // saves and restores everything as is
+
 	private:
 		vec4* vertices;
 		vec4* points;
+		unsigned numVertices;
 		unsigned vertIndex;
 		unsigned pointIndex;
-		unsigned lineIndex;
 		unsigned numPoints;
 		unsigned numNormalLinePoints;
 		unsigned drawOffset; // for external use
@@ -126,41 +278,82 @@ class Mesh {
 		vec4* normalLines;
 		float maxSize;
 
-		// add 3 identical normal vectors to normals array using newell method
-		// also add line segments to normalLines
-		void addNormal(vec4 a, vec4 b, vec4 c) {
+		// normals given with the vertices, used instead of face normals
+		// empty if there weren't any
+		vector<vec4> vertexNormals;
+
+		// indexed copy, built on request by buildIndexed
+		vector<GLuint> triangleIndices; // into vertices, as added
+		bool indexed;
+		bool indexedWeld, indexedReorder; // what buildIndexed was last asked for
+		vector<vec4> uniqueVertices;
+		vector<GLuint> indices; // into uniqueVertices
+		float missRatioBefore, missRatioAfter; // of indices around reordering, 0 if not reordered
+		GLintptr indexOffset; // for external use, bytes into an element buffer
+
+		VertexLayout layout; // how getBufferPoints is stored in the vertex buffer
+		GLuint vertexArray; // for external use, set up for layout
+
+		// positions compared exactly, for welding
+		struct Position {
+			GLfloat x, y, z;
+			bool operator<(const Position& other) const {
+				if(x != other.x) return x < other.x;
+				if(y != other.y) return y < other.y;
+				return z < other.z;
+			}
+		};
+
+		// set normals for triangle, made of vertices a, b and c, in the
+		// normals array, the vertices' own if there are any, otherwise 3
+		// identical face normals by the newell method
+		// also set its line segment in normalLines
+		void addNormal(unsigned triangle, unsigned a, unsigned b, unsigned c) {
+			unsigned pointIndex = triangle * 3;
+			unsigned lineIndex = triangle * 2;
+			vec4 verts[3] = {vertices[a], vertices[b], vertices[c]};
 			vec4 normal(0, 0, 0, 0);
-			// newell method
-			vec4 verts[3] = {a, b, c};
-			for(int i = 0; i < 3; i++) {
-				vec4 current = verts[i];
-				vec4 next = verts[(i + 1) % 3];
-				normal.x += (current.y - next.y)*(current.z + next.z);
-				normal.y += (current.z - next.z)*(current.x + next.x);
-				normal.z += (current.x - next.x)*(current.y + next.y);
-			}
-			normal = normalize(normal);
-			normals[pointIndex] = normals[pointIndex + 1] = normals[pointIndex + 2] = normal;
+			if(!vertexNormals.empty()) {
+				normals[pointIndex] = vertexNormals[a];
+				normals[pointIndex + 1] = vertexNormals[b];
+				normals[pointIndex + 2] = vertexNormals[c];
+				normal = vertexNormals[a] + vertexNormals[b] + vertexNormals[c];
+				if(length(normal) > 0) {
+					normal = normalize(normal);
+				}
+			} else {
+				// newell method
+				for(int i = 0; i < 3; i++) {
+					vec4 current = verts[i];
+					vec4 next = verts[(i + 1) % 3];
+					normal.x += (current.y - next.y)*(current.z + next.z);
+					normal.y += (current.z - next.z)*(current.x + next.x);
+					normal.z += (current.x - next.x)*(current.y + next.y);
+				}
+				normal = normalize(normal);
+				normals[pointIndex] = normals[pointIndex + 1] = normals[pointIndex + 2] = normal;
+			}
 			
 			// add a line to normalLines by finding center of face,
 			// adding a line through center along normal extending out by maxSize
-			if(maxSize == 0) {
-				maxSize = box->getMaxSize();
-			}
-			vec4 center = (a + b + c) / 3;
+			vec4 center = (verts[0] + verts[1] + verts[2]) / 3;
 			normalLines[lineIndex] = center;
-			normalLines[++lineIndex] = center + (maxSize/20 * normal);
-			lineIndex++;
+			normalLines[lineIndex + 1] = center + (maxSize/20 * normal);
 		}
 	
 	public:
 		Mesh(string _name, unsigned numVertices) {
 			name = _name;
+			this->numVertices = numVertices;
 			vertices = new vec4[numVertices];
 			vertIndex = 0;
 			maxSize = 0;
 			box = NULL;
 			normals = points = normalLines = NULL;
+			indexed = indexedWeld = indexedReorder = false;
+			missRatioBefore = missRatioAfter = 0;
+			indexOffset = 0;
+			vertexArray = 0;
 		}
 
 		string getName() {
@@ -176,6 +369,31 @@ class Mesh {
 			box->addContainedVertex(vert);
 		}
 
+		// for filling in vertices in any order or from several threads,
+		// instead of adding them: make room for whatever per vertex data
+		// there is, set every vertex, then finishVertices
+		void allocateVertexData(bool normals) {
+			vertexNormals.resize(normals ? numVertices : 0);
+		}
+
+		void setVertex(unsigned i, vec4 vert) {
+			vertices[i] = vert;
+		}
+
+		void setVertexNormal(unsigned i, vec4 normal) {
+			vertexNormals[i] = normal;
+		}
+
+		// all the vertices are set, min and max are the bounds found while
+		// setting them
+		void finishVertices(vec3 min, vec3 max) {
+			vertIndex = numVertices;
+			if(numVertices > 0) {
+				box = new BoundingBox(vec4(min, 1));
+				box->addContainedVertex(vec4(max, 1));
+			}
+		}
+
 		void startTriangles(unsigned numTriangles) {
 			numPoints = numTriangles * 3;
 			points = new vec4[numPoints];
@@ -183,17 +401,152 @@ class Mesh {
 			numNormalLinePoints = numTriangles * 2; // two points per face
 			normalLines = new vec4[numNormalLinePoints];
 			pointIndex = 0;
-			lineIndex = 0;
+			triangleIndices.resize(numPoints);
+			if(box != NULL) {
+				maxSize = box->getMaxSize();
+			}
 		}
 
 		void addTriangle(unsigned a, unsigned b, unsigned c) {
-			unsigned origIndex = pointIndex;
-			points[pointIndex] = vertices[a]; pointIndex++;
-			points[pointIndex] = vertices[b]; pointIndex++;
-			points[pointIndex] = vertices[c];
-			pointIndex = origIndex;
-			addNormal(vertices[a], vertices[b], vertices[c]);
-			pointIndex = origIndex + 3;
+			if(maxSize == 0) {
+				maxSize = box->getMaxSize();
+			}
+			setTriangle(pointIndex / 3, a, b, c);
+			pointIndex += 3;
+		}
+
+		// triangle i of those started, in any order or from several
+		// threads, once all the vertices are in
+		void setTriangle(unsigned i, unsigned a, unsigned b, unsigned c) {
+			unsigned point = i * 3;
+			points[point] = vertices[a];
+			points[point + 1] = vertices[b];
+			points[point + 2] = vertices[c];
+			addNormal(i, a, b, c);
+			triangleIndices[point] = a;
+			triangleIndices[point + 1] = b;
+			triangleIndices[point + 2] = c;
+		}
+
+		// build a copy that shares vertices between triangles instead of
+		// repeating them per face, which is what gets buffered and drawn
+		// weld merges vertices at the same position (fine since position
+		// is the only thing drawn per vertex), reorder sorts triangles for
+		// the vertex cache and vertices by first use
+		void buildIndexed(bool weld, bool reorder) {
+			vector<GLuint> remap(vertIndex);
+			uniqueVertices.clear();
+			if(weld) {
+				std::map<Position, GLuint> seen;
+				for(unsigned i = 0; i < vertIndex; i++) {
+					Position position = {vertices[i].x, vertices[i].y, vertices[i].z};
+					std::map<Position, GLuint>::iterator found = seen.find(position);
+					if(found == seen.end()) {
+						found = seen.insert(std::make_pair(position, (GLuint)uniqueVertices.size())).first;
+						uniqueVertices.push_back(vertices[i]);
+					}
+					remap[i] = found->second;
+				}
+			} else {
+				uniqueVertices.assign(vertices, vertices + vertIndex);
+				for(unsigned i = 0; i < vertIndex; i++) {
+					remap[i] = i;
+				}
+			}
+			indices.resize(triangleIndices.size());
+			for(size_t i = 0; i < triangleIndices.size(); i++) {
+				indices[i] = remap[triangleIndices[i]];
+			}
+
+			missRatioBefore = missRatioAfter = 0;
+			if(reorder) {
+				missRatioBefore = VertexCacheOptimizer::missRatio(indices);
+				VertexCacheOptimizer::reorder(indices, uniqueVertices.size());
+				missRatioAfter = VertexCacheOptimizer::missRatio(indices);
+				// renumber vertices in the order they're first used, so
+				// fetching them walks through memory, unused ones are dropped
+				vector<GLuint> order(uniqueVertices.size(), ~0u);
+				vector<vec4> sorted;
+				sorted.reserve(uniqueVertices.size());
+				for(size_t i = 0; i < indices.size(); i++) {
+					GLuint& newIndex = order[indices[i]];
+					if(newIndex == ~0u) {
+						newIndex = sorted.size();
+						sorted.push_back(uniqueVertices[indices[i]]);
+					}
+					indices[i] = newIndex;
+				}
+				uniqueVertices.swap(sorted);
+			}
+			indexed = true;
+			indexedWeld = weld;
+			indexedReorder = reorder;
+		}
+
+		bool isIndexed() {
+			return indexed;
+		}
+
+		// true if buildIndexed(weld, reorder) has nothing to do
+		bool isIndexedWith(bool weld, bool reorder) {
+			return indexed && indexedWeld == weld && indexedReorder == reorder;
+		}
+
+		// vertex cache misses per triangle before and after buildIndexed
+		// reordered the triangles, both 0 if it didn't
+		float getMissRatioBefore() {
+			return missRatioBefore;
+		}
+
+		float getMissRatioAfter() {
+			return missRatioAfter;
+		}
+
+		unsigned getNumUniqueVertices() {
+			return uniqueVertices.size();
+		}
+
+		unsigned getNumIndices() {
+			return indices.size();
+		}
+
+		// indices are stored as shorts when they fit
+		GLenum getIndexType() {
+			return uniqueVertices.size() <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+		}
+
+		GLsizeiptr getIndexBytes() {
+			return indices.size() * (getIndexType() == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint));
+		}
+
+		// write the indices into dest in the type getIndexType gives
+		void copyIndices(void* dest) {
+			if(getIndexType() == GL_UNSIGNED_SHORT) {
+				GLushort* shorts = (GLushort*)dest;
+				for(size_t i = 0; i < indices.size(); i++) {
+					shorts[i] = indices[i];
+				}
+			} else {
+				memcpy(dest, &indices[0], indices.size() * sizeof(GLuint));
+			}
+		}
+
+		const vector<GLuint>& getIndices() {
+			return indices;
+		}
+
+		GLintptr getIndexOffset() {
+			return indexOffset;
+		}
+
+		void setIndexOffset(GLintptr offset) {
+			indexOffset = offset;
+		}
+
+		// what goes in the vertex buffer: unique vertices if indexed, or
+		// three points per triangle
+		vec4* getBufferPoints() {
+			return indexed ? &uniqueVertices[0] : points;
 		}
 
 		unsigned getNumPoints() {
@@ -204,8 +557,39 @@ class Mesh {
 			return numNormalLinePoints;
 		}
 
+		unsigned getNumBufferPoints() {
+			return indexed ? uniqueVertices.size() : numPoints;
+		}
+
+		// size of getBufferPoints once packed with the mesh's layout
 		GLsizeiptr getNumBytes() {
-			return sizeof(points[0]) * numPoints;
+			return layout.getStride() * getNumBufferPoints();
+		}
+
+		// store positions in the vertex buffer like this from now on
+		// short positions are fit to the bounding box
+		void setLayout(VertexLayout layout) {
+			this->layout = layout;
+			if(box != NULL) {
+				this->layout.setBounds(box->getMin(), box->getMax());
+			}
+		}
+
+		VertexLayout& getLayout() {
+			return layout;
+		}
+
+		// write getBufferPoints to dest in the mesh's layout, without normals
+		void packBufferPoints(void* dest) {
+			layout.pack(getBufferPoints(), NULL, getNumBufferPoints(), dest);
+		}
+
+		GLuint getVertexArray() {
+			return vertexArray;
+		}
+
+		void setVertexArray(GLuint vao) {
+			vertexArray = vao;
 		}
 
 		vec4* getPoints() {
@@ -220,6 +604,7 @@ class Mesh {
 			return normalLines;
 		}
 
+		// in vertices, where getBufferPoints starts for its vertex array
 		unsigned getDrawOffset() {
 			return drawOffset;
 		}
@@ -0,0 +1,324 @@
+#ifndef __MESHCACHE_H_
+#define __MESHCACHE_H_
+
+#include <string>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "Mesh.hpp"
+#include "MappedFile.hpp"
+#include "PLYReader.hpp"
+#include "ReaderException.hpp"
+
+using std::string;
+using std::cout;
+using std::endl;
+
+// keeps meshes as PLYReader leaves them, triangles, normals, normal lines
+// and bounds included, in <file>.meshcache next to each PLY file, so later
+// runs map that in instead of parsing and working it all out again
+// meshes are indexed as setIndexing says before they're cached, and the
+// indexed copy is only used by runs asking for the same weld and reorder
+// a cache belongs to the source path, size, modification time and a hash
+// of the contents it was made from, and is remade when they don't match
+// (a new modification time alone is fine if the contents hash the same)
+// caches are in this machine's byte order and float layout
+class MeshCache {
+	private:
+		static const GLuint version = 3;
+		static const GLuint byteOrder = 0x01020304; // reads differently elsewhere
+		enum { VERTEX_NORMALS = 1, INDEXED = 2, WELDED = 4, REORDERED = 8 };
+		static const GLuint indexFlags = INDEXED | WELDED | REORDERED;
+
+		// followed by the source path, padded to 4 bytes, then the arrays
+		// in the order readCache reads them
+		struct Header {
+			char magic[8];
+			GLuint version;
+			GLuint byteOrder;
+			unsigned long long sourceSize;
+			long long sourceTime; // in nanoseconds
+			unsigned long long sourceHash;
+			GLuint pathLength;
+			GLuint numVertices;
+			GLuint numTriangles;
+			GLuint flags; // which per vertex arrays there are, and how it's indexed
+			GLfloat min[3];
+			GLfloat max[3];
+			GLuint numUniqueVertices; // of the indexed copy, if there is one
+			GLfloat missRatioBefore, missRatioAfter;
+		};
+
+		bool enabled;
+		bool index, weld, reorder; // what buildIndexed is run with, if index is set
+
+		static string cachePath(const char* source) {
+			return string(source) + ".meshcache";
+		}
+
+		static size_t paddedPathLength(size_t length) {
+			return (length + 3) / 4 * 4;
+		}
+
+		// bytes of everything after the header and path
+		static size_t arrayBytes(const Header& header) {
+			size_t vertexBytes = sizeof(vec4);
+			if(header.flags & VERTEX_NORMALS) {
+				vertexBytes += sizeof(vec4);
+			}
+			// three points, three normals, two normal line ends and three indices each
+			size_t triangleBytes = 8 * sizeof(vec4) + 3 * sizeof(GLuint);
+			size_t indexedBytes = 0;
+			if(header.flags & INDEXED) {
+				indexedBytes = header.numUniqueVertices * sizeof(vec4)
+					+ (size_t)header.numTriangles * 3 * sizeof(GLuint);
+			}
+			return header.numVertices * vertexBytes + (size_t)header.numTriangles * triangleBytes
+				+ indexedBytes;
+		}
+
+		// the index flags a cache made with the current settings has
+		GLuint wantedIndexFlags() {
+			if(!index) {
+				return 0;
+			}
+			return INDEXED | (weld ? WELDED : 0) | (reorder ? REORDERED : 0);
+		}
+
+		// modification time in nanoseconds, or -1 where only whole seconds
+		// are kept, which can't tell apart two writes in the same second
+		static long long modificationTime(const struct stat& info) {
+#if defined(_WIN32)
+			return -1;
+#elif defined(__APPLE__)
+			return info.st_mtimespec.tv_sec * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+			return info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+		}
+
+		// 64 bit FNV-1a
+		static unsigned long long hash(const char* bytes, size_t size) {
+			unsigned long long h = 14695981039346656037ULL;
+			for(size_t i = 0; i < size; i++) {
+				h = (h ^ (unsigned char)bytes[i]) * 1099511628211ULL;
+			}
+			return h;
+		}
+
+		static unsigned long long hashFile(const char* source) {
+			MappedFile file(source);
+			return hash(file.getBytes(), file.getSize());
+		}
+
+		static void copyOut(void* dest, const char*& from, size_t bytes) {
+			if(bytes > 0) {
+				memcpy(dest, from, bytes);
+			}
+			from += bytes;
+		}
+
+		static void writeBytes(FILE* file, const void* data, size_t bytes, bool& ok) {
+			if(bytes > 0 && fwrite(data, 1, bytes, file) != bytes) {
+				ok = false;
+			}
+		}
+
+		// the cached mesh for source, NULL if there's no cache or it's stale
+		// it's only indexed if the cache was indexed with the current settings
+		Mesh* readCache(const char* source, unsigned long long size, long long time) {
+			string path = cachePath(source);
+			struct stat info;
+			if(stat(path.c_str(), &info) != 0) {
+				return NULL;
+			}
+			MappedFile file(path.c_str());
+			Header header;
+			size_t length = strlen(source);
+			if(file.getSize() < sizeof(header)) {
+				return NULL;
+			}
+			memcpy(&header, file.getBytes(), sizeof(header));
+			const char* at = file.getBytes() + sizeof(header);
+			if(strncmp(header.magic, "meshcach", sizeof(header.magic)) != 0
+					|| header.version != version || header.byteOrder != byteOrder
+					|| header.pathLength != length || header.sourceSize != size
+					|| file.getSize() != sizeof(header) + paddedPathLength(length) + arrayBytes(header)
+					|| memcmp(at, source, length) != 0) {
+				return NULL;
+			}
+			if(time < 0 || header.sourceTime != time) {
+				if(hashFile(source) != header.sourceHash) {
+					return NULL;
+				}
+				// same contents, so it only needs the new time
+				FILE* out = time < 0 ? NULL : fopen(path.c_str(), "r+b");
+				if(out != NULL) {
+					header.sourceTime = time;
+					fwrite(&header, sizeof(header), 1, out);
+					fclose(out);
+				}
+			}
+			at += paddedPathLength(length);
+
+			unsigned numVertices = header.numVertices;
+			Mesh* mesh = new Mesh(source, numVertices);
+			copyOut(mesh->vertices, at, numVertices * sizeof(vec4));
+			mesh->allocateVertexData(header.flags & VERTEX_NORMALS);
+			if(header.flags & VERTEX_NORMALS) {
+				copyOut(&mesh->vertexNormals[0], at, numVertices * sizeof(vec4));
+			}
+			mesh->finishVertices(vec3(header.min[0], header.min[1], header.min[2]),
+					vec3(header.max[0], header.max[1], header.max[2]));
+
+			unsigned numPoints = header.numTriangles * 3;
+			mesh->startTriangles(header.numTriangles);
+			copyOut(mesh->points, at, numPoints * sizeof(vec4));
+			copyOut(mesh->normals, at, numPoints * sizeof(vec4));
+			copyOut(mesh->normalLines, at, mesh->numNormalLinePoints * sizeof(vec4));
+			copyOut(numPoints > 0 ? &mesh->triangleIndices[0] : NULL, at, numPoints * sizeof(GLuint));
+			mesh->pointIndex = numPoints;
+
+			GLuint indexed = header.flags & indexFlags;
+			if(indexed != 0 && indexed == wantedIndexFlags()) {
+				mesh->uniqueVertices.resize(header.numUniqueVertices);
+				mesh->indices.resize(numPoints);
+				copyOut(header.numUniqueVertices > 0 ? &mesh->uniqueVertices[0] : NULL, at,
+						header.numUniqueVertices * sizeof(vec4));
+				copyOut(numPoints > 0 ? &mesh->indices[0] : NULL, at, numPoints * sizeof(GLuint));
+				mesh->missRatioBefore = header.missRatioBefore;
+				mesh->missRatioAfter = header.missRatioAfter;
+				mesh->indexed = true;
+				mesh->indexedWeld = weld;
+				mesh->indexedReorder = reorder;
+			}
+			return mesh;
+		}
+
+		// write mesh to source's cache, written to the side and renamed
+		// over the old one so a half written cache is never read
+		void writeCache(Mesh* mesh, const char* source, unsigned long long size, long long time) {
+			Header header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, "meshcach", sizeof(header.magic));
+			header.version = version;
+			header.byteOrder = byteOrder;
+			header.sourceSize = size;
+			header.sourceTime = time;
+			header.sourceHash = hashFile(source);
+			header.pathLength = strlen(source);
+			header.numVertices = mesh->vertIndex;
+			header.numTriangles = mesh->numPoints / 3;
+			header.flags = mesh->vertexNormals.empty() ? 0 : VERTEX_NORMALS;
+			if(mesh->indexed) {
+				header.flags |= INDEXED | (mesh->indexedWeld ? WELDED : 0)
+					| (mesh->indexedReorder ? REORDERED : 0);
+				header.numUniqueVertices = mesh->uniqueVertices.size();
+				header.missRatioBefore = mesh->missRatioBefore;
+				header.missRatioAfter = mesh->missRatioAfter;
+			}
+			if(mesh->box != NULL) {
+				vec3 min = mesh->box->getMin();
+				vec3 max = mesh->box->getMax();
+				for(int axis = 0; axis < 3; axis++) {
+					header.min[axis] = min[axis];
+					header.max[axis] = max[axis];
+				}
+			}
+
+			string path = cachePath(source);
+			string temporary = path + ".tmp";
+			FILE* file = fopen(temporary.c_str(), "wb");
+			if(file == NULL) {
+				cout << "can't write " << path << endl;
+				return;
+			}
+			bool ok = true;
+			unsigned numVertices = header.numVertices;
+			unsigned numPoints = header.numTriangles * 3;
+			char padding[4] = { 0, 0, 0, 0 };
+			writeBytes(file, &header, sizeof(header), ok);
+			writeBytes(file, source, header.pathLength, ok);
+			writeBytes(file, padding, paddedPathLength(header.pathLength) - header.pathLength, ok);
+			writeBytes(file, mesh->vertices, numVertices * sizeof(vec4), ok);
+			if(!mesh->vertexNormals.empty()) {
+				writeBytes(file, &mesh->vertexNormals[0], numVertices * sizeof(vec4), ok);
+			}
+			writeBytes(file, mesh->points, numPoints * sizeof(vec4), ok);
+			writeBytes(file, mesh->normals, numPoints * sizeof(vec4), ok);
+			writeBytes(file, mesh->normalLines, mesh->numNormalLinePoints * sizeof(vec4), ok);
+			if(numPoints > 0) {
+				writeBytes(file, &mesh->triangleIndices[0], numPoints * sizeof(GLuint), ok);
+			}
+			if(mesh->indexed) {
+				if(!mesh->uniqueVertices.empty()) {
+					writeBytes(file, &mesh->uniqueVertices[0], mesh->uniqueVertices.size() * sizeof(vec4), ok);
+				}
+				if(numPoints > 0) {
+					writeBytes(file, &mesh->indices[0], numPoints * sizeof(GLuint), ok);
+				}
+			}
+			ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+			remove(path.c_str()); // rename won't replace a file there
+#endif
+			if(!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+				remove(temporary.c_str());
+				cout << "can't write " << path << endl;
+			}
+		}
+
+	public:
+		MeshCache() {
+			enabled = true;
+			index = weld = reorder = true;
+		}
+
+		// read every mesh from its PLY file, without touching caches
+		void setEnabled(bool enabled) {
+			this->enabled = enabled;
+		}
+
+		// index cached meshes with buildIndexed(weld, reorder), or leave
+		// them unindexed if index isn't set
+		void setIndexing(bool index, bool weld, bool reorder) {
+			this->index = index;
+			this->weld = weld;
+			this->reorder = reorder;
+		}
+
+		// the mesh in the PLY file source, from its cache if that's up to
+		// date, otherwise read and cached for next time
+		// caller is responsible for deleting Mesh when done
+		Mesh* load(const char* source) {
+			struct stat info;
+			if(!enabled || stat(source, &info) != 0) {
+				PLYReader reader(source);
+				return reader.read();
+			}
+			unsigned long long size = info.st_size;
+			long long time = modificationTime(info);
+
+			Mesh* mesh = readCache(source, size, time);
+			if(mesh != NULL && (!index || mesh->isIndexed())) {
+				return mesh;
+			}
+			if(mesh == NULL) {
+				PLYReader reader(source);
+				mesh = reader.read();
+			}
+			if(index) {
+				mesh->buildIndexed(weld, reorder);
+			}
+			writeCache(mesh, source, size, time);
+			return mesh;
+		}
+};
+
+// for loading every mesh
+static MeshCache meshCache;
+
+#endif
@@ -3,27 +3,42 @@
 #define __MESHRENDERER_H_
 
 #include <vector>
+#include <map>
+#include <list>
 #include <algorithm>
 
 #include "Mesh.hpp"
+#include "ShaderProgram.hpp"
+#include "BufferArena.hpp"
 
 using std::vector;
+using std::map;
+using std::list;
 using std::cout;
 using std::endl;
 
 // renders a chosen mesh from a list of meshes
 class MeshRenderer {
 	private:
-		GLuint program;
+		ShaderProgram* program;
 		vector<Mesh*> meshes; // all meshes this can render
 		unsigned currentMeshIndex;
 		Mesh* currentMesh;
 
 		GLsizeiptr meshLength;
 		GLsizeiptr boxLength;
-		GLsizeiptr normalLength;
 		GLsizeiptr lineLength;
-		GLsizeiptr triangleLength;
+		VertexLayout layout; // how the current mesh's vertices are stored
+		GLintptr boxOffset; // box and normal lines follow as plain vec4s
+		GLintptr lineOffset;
+
+		// meshes stay uploaded after they're shown, until they take up more
+		// than maxResidentBytes
+		BufferArena* arena;
+		map<Mesh*, BufferRange*> resident;
+		list<Mesh*> shown; // resident meshes, least recently shown first
+		BufferRange* currentRange;
+		static const GLsizeiptr maxResidentBytes = 64 << 20;
 		
 		mat4 modelView;
 		mat4 projection;
@@ -50,48 +65,61 @@ class MeshRenderer {
 			currentMeshIndex = index;
 			cout << currentMesh->getName() << endl;
 			
+			// mesh vertices with their normals interleaved, in the mesh's own
+			// position format and packed normals where the hardware has them
 			meshLength = currentMesh->getNumPoints();
-			vec4* meshPoints = currentMesh->getPoints();
-			GLsizeiptr meshBytes = sizeof(meshPoints[0]) * meshLength;
-			
+			layout = currentMesh->getLayout();
+			layout.setNormalFormat(GLEW_VERSION_3_3 ? VertexLayout::NORMAL_PACKED
+					: VertexLayout::NORMAL_FLOAT4);
+			GLsizeiptr meshBytes = layout.getStride() * meshLength;
+
 			BoundingBox* box = currentMesh->getBoundingBox();
 			boxLength = box->getNumPoints();
 			vec4* boxPoints = box->getPoints();
 			GLsizeiptr boxBytes = sizeof(boxPoints[0]) * boxLength;
 
-			vec4* normals = currentMesh->getNormals();
-			normalLength = meshLength;
-			GLsizeiptr normalBytes = meshBytes;
-
 			vec4* lines = currentMesh->getNormalLines();
 			lineLength = currentMesh->getNumNormalLinePoints();
 			GLsizeiptr lineBytes = sizeof(lines[0]) * lineLength;
 
-			GLsizeiptr totalBytes = meshBytes + boxBytes + normalBytes + lineBytes;
-			glBufferData(GL_ARRAY_BUFFER, totalBytes, NULL, GL_STATIC_DRAW);
-			glBufferSubData(GL_ARRAY_BUFFER, 0, meshBytes, meshPoints);
-			glBufferSubData(GL_ARRAY_BUFFER, meshBytes, boxBytes, boxPoints);
-			glBufferSubData(GL_ARRAY_BUFFER, meshBytes + boxBytes, normalBytes, normals);
-			glBufferSubData(GL_ARRAY_BUFFER, meshBytes + boxBytes + normalBytes, lineBytes, lines);
-
-			// set up vertex arrays
-			GLuint posLoc = glGetAttribLocation(program, "vPosition");
-			glEnableVertexAttribArray(posLoc);
-			glVertexAttribPointer(posLoc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-			
-			triangleLength = meshLength + boxLength;
-			GLsizeiptr normalOffset = triangleLength * sizeof(currentMesh->getPoints()[0]);
-
-			// set up normal array, which is after all triangles
-			GLuint normalLoc = glGetAttribLocation(program, "normal");
-			glEnableVertexAttribArray(normalLoc);
-			glVertexAttribPointer(normalLoc, 4, GL_FLOAT, GL_FALSE, 0,
-					BUFFER_OFFSET(normalOffset));
+			boxOffset = meshBytes;
+			lineOffset = boxOffset + boxBytes;
+
+			// meshes shown before are still in the arena
+			currentRange = resident[currentMesh];
+			if(currentRange == NULL) {
+				evictUntilFree(meshBytes + boxBytes + lineBytes);
+				vector<char> packed(meshBytes);
+				layout.pack(currentMesh->getPoints(), currentMesh->getNormals(), meshLength, &packed[0]);
+				currentRange = arena->allocate(meshBytes + boxBytes + lineBytes);
+				arena->upload(currentRange, &packed[0], meshBytes);
+				arena->upload(currentRange, boxPoints, boxBytes, boxOffset);
+				arena->upload(currentRange, lines, lineBytes, lineOffset);
+				resident[currentMesh] = currentRange;
+			}
+			shown.remove(currentMesh);
+			shown.push_back(currentMesh);
 
 			resetState();
 			glutPostRedisplay();
 		}
 
+		// evict the meshes shown longest ago until bytes more would fit in
+		// maxResidentBytes, never the one being shown
+		void evictUntilFree(GLsizeiptr bytes) {
+			bool evicted = false;
+			while(!shown.empty() && shown.front() != currentMesh
+					&& arena->getUsedBytes() + bytes > maxResidentBytes) {
+				arena->release(resident[shown.front()]);
+				resident.erase(shown.front());
+				shown.pop_front();
+				evicted = true;
+			}
+			if(evicted) {
+				arena->defragment();
+			}
+		}
+
 		void resetProjection() {
 			if(screenHeight == 0) {
 				projection = mat4(); // don't want to divide by zero...
@@ -111,13 +139,14 @@ class MeshRenderer {
 
 
 	public:
-		MeshRenderer(vector<Mesh*> _meshes, GLuint _program) {
+		MeshRenderer(vector<Mesh*> _meshes, ShaderProgram* _program) {
 			meshes = _meshes;
 			program = _program;
 			showBoundingBox = false;
 			breathe = false;
 			showNormals = false;
 			lastTicks = 0;
+			arena = new BufferArena();
 			showMesh(0);
 		}
 
@@ -202,24 +231,37 @@ class MeshRenderer {
 			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 			
 			// hook up matrices with shader
-			GLuint modelLoc = glGetUniformLocationARB(program, "model_matrix");
-			glUniformMatrix4fv(modelLoc, 1, GL_TRUE, modelView);
-			GLuint projLoc = glGetUniformLocationARB(program, "projection_matrix");
-			glUniformMatrix4fv(projLoc, 1, GL_TRUE, projection);
+			GLint modelLoc = program->uniform("model_matrix");
+			program->setUniform(modelLoc, modelView * layout.getDecodeMatrix());
+			program->setUniform(program->uniform("projection_matrix"), projection);
 
-			GLuint scaleLoc = glGetUniformLocation(program, "normal_scale");
-			glUniform1f(scaleLoc, normalScale);
+			GLint scaleLoc = program->uniform("normal_scale");
+			program->setUniform(scaleLoc, normalScale);
 
 			// draw triangles
+			GLint posLoc = program->attribute("vPosition");
+			GLint normalLoc = program->attribute("normal");
 			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 			glEnable(GL_DEPTH_TEST);
+			glBindBuffer(GL_ARRAY_BUFFER, arena->getBuffer());
+			layout.setPointers(posLoc, normalLoc, currentRange->offset);
 			glDrawArrays(GL_TRIANGLES, 0, meshLength);
-			glUniform1f(scaleLoc, 0); // everything after this is unscaled
+
+			// everything after this is unscaled vec4s without normals
+			program->setUniform(scaleLoc, 0.0f);
+			program->setUniform(modelLoc, modelView);
+			if(normalLoc >= 0) {
+				glDisableVertexAttribArray(normalLoc);
+			}
 			if(showBoundingBox) {
-				glDrawArrays(GL_TRIANGLES, meshLength, boxLength);
+				glVertexAttribPointer(posLoc, 4, GL_FLOAT, GL_FALSE, 0,
+						BUFFER_OFFSET(currentRange->offset + boxOffset));
+				glDrawArrays(GL_TRIANGLES, 0, boxLength);
 			}
 			if(showNormals) {
-				glDrawArrays(GL_LINES, meshLength + boxLength + normalLength, lineLength);
+				glVertexAttribPointer(posLoc, 4, GL_FLOAT, GL_FALSE, 0,
+						BUFFER_OFFSET(currentRange->offset + lineOffset));
+				glDrawArrays(GL_LINES, 0, lineLength);
 			}
 			glDisable(GL_DEPTH_TEST); 
 
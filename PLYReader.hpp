@@ -2,108 +2,739 @@
 #ifndef __PLYREADER_H_
 #define __PLYREADER_H_
 
+#include <string>
+#include <vector>
 #include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
 
 #include "Mesh.hpp"
-#include "textfile.cpp"
+#include "MappedFile.hpp"
+#include "Parallel.hpp"
 #include "ReaderException.hpp"
 
 using std::string;
+using std::vector;
 using std::stringstream;
 using std::endl;
 using std::cout;
 
-// reads a PLY file
+// reads a PLY file, ascii or binary of either byte order
+// the header is read a line at a time into the elements and their
+// properties, then the body is scanned in place in the mapped file, so
+// nothing is copied or allocated per vertex or face
+// vertices give the mesh their positions and any normals, colors and
+// texture coordinates, faces are split into triangles, and anything else
+// is skipped
+// binary floats and 32 bit indices in this machine's byte order are
+// copied out of the file as they are, with nothing to convert
+// big ascii bodies are split into chunks of whole lines that are read on
+// their own threads, each writing its vertices straight into the mesh
 class PLYReader {
 	private:
-		string content;
-		Mesh* mesh;
-		int verticesLeft;
-		int trianglesLeft;
-		const char* filename;
+		// where the header is up to, properties belong to the last element
+		enum HeaderState { MAGIC, FORMAT, ELEMENTS };
+		enum Format { ASCII, BINARY_LITTLE_ENDIAN, BINARY_BIG_ENDIAN };
+		enum Type { INT8, UINT8, INT16, UINT16, INT32, UINT32, FLOAT32, FLOAT64 };
+		// what vertex properties are used for
+		enum Role { X, Y, Z, NX, NY, NZ, ROLES };
 
-	public:
-		PLYReader(const char* _filename) {
-			content = string(textFileRead(_filename));
-			filename = _filename;
+		// ascii bodies smaller than this aren't worth splitting up
+		static const size_t minParallelBytes = 1 << 18;
+
+		struct Property {
+			string name;
+			Type type; // of the values, for lists too
+			bool list;
+			Type countType; // of a list's length
+			int role; // a Role, -1 if not used
+			size_t offset; // bytes into a binary vertex, if they're all one size
+		};
+
+		struct Element {
+			string name;
+			unsigned count;
+			vector<Property> properties;
+		};
+
+		static bool littleEndian() {
+			unsigned short one = 1;
+			unsigned char first;
+			memcpy(&first, &one, 1);
+			return first == 1;
 		}
 
-		// returns a Mesh containing data from ply file
-		// caller is responsible for deleting Mesh when done
-		Mesh* read() {
-			verticesLeft = -1;
-			trianglesLeft = -1;
-			stringstream stream(content, stringstream::in);
-			string line;
-			unsigned lineNum = 0;
-			while(getline(stream, line)) {
-				parseLine(line, lineNum);
+		static size_t typeSize(Type type) {
+			switch(type) {
+				case INT8:
+				case UINT8:
+					return 1;
+				case INT16:
+				case UINT16:
+					return 2;
+				case FLOAT64:
+					return 8;
+				default:
+					return 4;
+			}
+		}
+
+		// a binary value of type in this machine's byte order
+		static double valueAt(const unsigned char* raw, Type type) {
+			switch(type) {
+				case INT8: { signed char v; memcpy(&v, raw, 1); return v; }
+				case UINT8: return raw[0];
+				case INT16: { short v; memcpy(&v, raw, 2); return v; }
+				case UINT16: { unsigned short v; memcpy(&v, raw, 2); return v; }
+				case INT32: { int v; memcpy(&v, raw, 4); return v; }
+				case UINT32: { unsigned v; memcpy(&v, raw, 4); return v; }
+				case FLOAT32: { float v; memcpy(&v, raw, 4); return v; }
+				default: { double v; memcpy(&v, raw, 8); return v; }
+			}
+		}
+
+		// a place in the file and how to read what's there
+		// every thread reading part of the body has its own
+		struct Scanner {
+			const char* filename;
+			const char* begin; // of the file
+			const char* cursor; // next character to scan
+			const char* end;
+			Format format;
+			bool swapBytes; // binary in the other byte order to this machine
+			bool inBody;
+			unsigned lineNum;
+
+			void fail(const string& reason) {
+				stringstream message;
+				message << filename;
+				if(inBody && format != ASCII) {
+					message << " byte " << cursor - begin;
+				} else {
+					message << " line " << lineNum + 1;
+				}
+				message << ": " << reason;
+				throw ReaderException(message.str());
+			}
+
+			// spaces within a line, not line ends
+			void skipSpaces() {
+				while(cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')) {
+					cursor++;
+				}
+			}
+
+			// past the end of this line, whatever is left on it
+			void nextLine() {
+				while(cursor < end && *cursor != '\n') {
+					cursor++;
+				}
+				if(cursor < end) {
+					cursor++;
+				}
 				lineNum++;
 			}
-			if(verticesLeft != 0) {
-				throw ReaderException("Not enough vertices");
+
+			// skips word and the spaces after it if it's next on the line
+			bool match(const char* word) {
+				size_t length = strlen(word);
+				if((size_t)(end - cursor) < length || strncmp(cursor, word, length) != 0) {
+					return false;
+				}
+				char after = cursor + length < end ? cursor[length] : '\n';
+				if(after != ' ' && after != '\t' && after != '\r' && after != '\n') {
+					return false;
+				}
+				cursor += length;
+				skipSpaces();
+				return true;
 			}
-			if(trianglesLeft != 0) {
-				throw ReaderException("Not enough triangles");
+
+			bool atLineEnd() {
+				skipSpaces();
+				return cursor == end || *cursor == '\n';
+			}
+
+			// a name in the header, up to the next space
+			string scanWord() {
+				if(atLineEnd()) {
+					fail("expected a name");
+				}
+				const char* start = cursor;
+				while(cursor < end && *cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '\n') {
+					cursor++;
+				}
+				string word(start, cursor);
+				skipSpaces();
+				return word;
+			}
+
+			Type scanType() {
+				const char* names[] = { "char", "uchar", "short", "ushort", "int", "uint", "float", "double" };
+				const char* sizedNames[] = { "int8", "uint8", "int16", "uint16", "int32", "uint32", "float32", "float64" };
+				for(int type = INT8; type <= FLOAT64; type++) {
+					if(match(names[type]) || match(sizedNames[type])) {
+						return (Type)type;
+					}
+				}
+				fail("unknown property type");
+				return FLOAT32;
+			}
+
+			float scanFloat() {
+				if(atLineEnd()) {
+					fail("expected a number");
+				}
+				// strtof needs a null somewhere after the number, which the
+				// mapped file only has if it's followed by something else
+				char tail[64];
+				const char* start = cursor;
+				if(end - cursor < (long)sizeof(tail)) {
+					memcpy(tail, cursor, end - cursor);
+					tail[end - cursor] = '\0';
+					start = tail;
+				}
+				char* stop;
+				float value = strtof(start, &stop);
+				if(stop == start) {
+					fail("expected a number");
+				}
+				cursor += stop - start;
+				return value;
+			}
+
+			unsigned scanUnsigned() {
+				if(atLineEnd() || *cursor < '0' || *cursor > '9') {
+					fail("expected a count or index");
+				}
+				unsigned long long value = 0;
+				while(cursor < end && *cursor >= '0' && *cursor <= '9') {
+					value = value * 10 + (*cursor - '0');
+					if(value > 0xffffffffu) {
+						fail("number too big");
+					}
+					cursor++;
+				}
+				return (unsigned)value;
+			}
+
+			// one binary value of type, in the file's byte order
+			double readValue(Type type) {
+				size_t size = typeSize(type);
+				if((size_t)(end - cursor) < size) {
+					fail("file ended early");
+				}
+				unsigned char raw[8];
+				memcpy(raw, cursor, size);
+				cursor += size;
+				if(swapBytes) {
+					for(size_t i = 0; i < size / 2; i++) {
+						std::swap(raw[i], raw[size - 1 - i]);
+					}
+				}
+				return valueAt(raw, type);
+			}
+
+			// the next scalar value, ascii or binary
+			// floats in our byte order are taken as they are
+			float nextValue(Type type) {
+				if(format == ASCII) {
+					return scanFloat();
+				}
+				if(type == FLOAT32 && !swapBytes) {
+					if((size_t)(end - cursor) < sizeof(float)) {
+						fail("file ended early");
+					}
+					float value;
+					memcpy(&value, cursor, sizeof(float));
+					cursor += sizeof(float);
+					return value;
+				}
+				return readValue(type);
+			}
+
+			// a list length or index, ascii or binary
+			unsigned nextUnsigned(Type type) {
+				if(format == ASCII) {
+					return scanUnsigned();
+				}
+				double value = readValue(type);
+				if(value < 0 || value > 0xffffffffu || value != (unsigned)value) {
+					fail("expected a count or index");
+				}
+				return (unsigned)value;
+			}
+
+			// past one value without converting it
+			void skipValue(Type type) {
+				if(format != ASCII) {
+					if((size_t)(end - cursor) < typeSize(type)) {
+						fail("file ended early");
+					}
+					cursor += typeSize(type);
+					return;
+				}
+				if(atLineEnd()) {
+					fail("expected a number");
+				}
+				while(cursor < end && *cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '\n') {
+					cursor++;
+				}
+			}
+
+			// past a property that isn't used
+			void skipProperty(const Property& property) {
+				if(!property.list) {
+					skipValue(property.type);
+					return;
+				}
+				unsigned count = nextUnsigned(property.countType);
+				for(unsigned i = 0; i < count; i++) {
+					skipValue(property.type);
+				}
+			}
+		};
+
+		// part of the body read by one thread, a run of whole items
+		// (lines, in ascii) across the elements in the order they come
+		struct Chunk {
+			Scanner scanner; // starts at the first item
+			unsigned long long firstItem;
+			unsigned long long lastItem; // one past
+			vec3 min, max; // of the vertices read
+			bool anyVertices;
+			vector<GLuint> triangles; // three indices each, in file order
+			size_t firstTriangle; // where they go in the mesh
+			string error; // what went wrong, empty if nothing
+		};
+
+		MappedFile file;
+		const char* filename;
+		Scanner scanner; // for the header, and the body if it isn't split
+		vector<Element> elements; // as declared in the header
+		Element* vertices;
+		Element* faces; // NULL if there aren't any
+		int faceIndices; // the property of faces listing their vertices
+		bool hasNormals;
+		unsigned threads;
+		// binary vertices that are all vertexStride bytes, with x, y and z
+		// floats in our byte order, are read from where the schema says
+		// they are rather than value by value
+		bool directVertices;
+		size_t vertexStride;
+		size_t positionOffsets[3];
+		vector<Property> otherVertexProperties; // used ones besides x, y and z
+
+		// what a vertex property is for, from its name
+		static int roleOf(const string& name) {
+			const char* names[] = { "x", "y", "z", "nx", "ny", "nz" };
+			const int roles[] = { X, Y, Z, NX, NY, NZ };
+			for(size_t i = 0; i < sizeof(roles) / sizeof(roles[0]); i++) {
+				if(name == names[i]) {
+					return roles[i];
+				}
+			}
+			return -1;
+		}
+
+		// read header lines up to and including end_header, into elements
+		void readHeader() {
+			HeaderState state = MAGIC;
+			while(true) {
+				if(scanner.cursor == scanner.end) {
+					scanner.fail("file ended in the header");
+				}
+				if(state == MAGIC) {
+					if(!scanner.match("ply")) {
+						scanner.fail("doesn't start with ply");
+					}
+					state = FORMAT;
+				} else if(scanner.match("comment") || scanner.match("obj_info")) {
+					// nothing to read
+				} else if(state == FORMAT) {
+					if(!scanner.match("format")) {
+						scanner.fail("expected the format");
+					}
+					if(scanner.match("ascii")) {
+						scanner.format = ASCII;
+					} else if(scanner.match("binary_little_endian")) {
+						scanner.format = BINARY_LITTLE_ENDIAN;
+					} else if(scanner.match("binary_big_endian")) {
+						scanner.format = BINARY_BIG_ENDIAN;
+					} else {
+						scanner.fail("unknown format");
+					}
+					if(!scanner.match("1.0")) {
+						scanner.fail("only version 1.0 PLY files are supported");
+					}
+					scanner.swapBytes = scanner.format != ASCII
+						&& (scanner.format == BINARY_LITTLE_ENDIAN) != littleEndian();
+					state = ELEMENTS;
+				} else if(scanner.match("element")) {
+					Element element;
+					element.name = scanner.scanWord();
+					element.count = scanner.scanUnsigned();
+					elements.push_back(element);
+				} else if(scanner.match("property")) {
+					if(elements.empty()) {
+						scanner.fail("property before any element");
+					}
+					Property property;
+					property.list = scanner.match("list");
+					property.countType = property.list ? scanner.scanType() : UINT8; // only read for lists
+					property.type = scanner.scanType();
+					property.name = scanner.scanWord();
+					property.role = -1;
+					property.offset = 0;
+					elements.back().properties.push_back(property);
+				} else if(scanner.match("end_header")) {
+					scanner.nextLine();
+					return;
+				} else {
+					scanner.fail("unknown header line");
+				}
+				scanner.nextLine();
 			}
-			return mesh;
 		}
 
-		void parseLine(string line, unsigned lineNum) {
-			if(lineNum == 0) {
-				if(!startsWith(line, "ply")) {
-					throw ReaderException("Line 0 doesn't start with Ply");
+		// find the vertices and faces in the elements and what each of
+		// their properties is for
+		void readSchema() {
+			vertices = faces = NULL;
+			for(size_t e = 0; e < elements.size(); e++) {
+				if(elements[e].name == "vertex" && vertices == NULL) {
+					vertices = &elements[e];
+				} else if(elements[e].name == "face" && faces == NULL) {
+					faces = &elements[e];
 				}
-				return;
 			}
-			if(startsWith(line, "format ascii 1.0")
-					|| startsWith(line, "property")
-					|| startsWith(line, "end_header")) {
-				return;
+			if(vertices == NULL) {
+				scanner.fail("no vertex element");
 			}
+			bool found[ROLES];
+			for(int role = 0; role < ROLES; role++) {
+				found[role] = false;
+			}
+			for(size_t p = 0; p < vertices->properties.size(); p++) {
+				Property& property = vertices->properties[p];
+				if(!property.list) {
+					property.role = roleOf(property.name);
+				}
+				if(property.role >= 0) {
+					found[property.role] = true;
+				}
+			}
+			if(!found[X] || !found[Y] || !found[Z]) {
+				scanner.fail("vertices need x, y and z");
+			}
+			// offsets of every property, if no vertex has a list to make
+			// it longer than the others
+			directVertices = scanner.format != ASCII && !scanner.swapBytes;
+			vertexStride = 0;
+			otherVertexProperties.clear();
+			for(size_t p = 0; p < vertices->properties.size(); p++) {
+				Property& property = vertices->properties[p];
+				property.offset = vertexStride;
+				vertexStride += typeSize(property.type);
+				if(property.list || (property.role >= X && property.role <= Z && property.type != FLOAT32)) {
+					directVertices = false;
+				} else if(property.role >= X && property.role <= Z) {
+					positionOffsets[property.role] = property.offset;
+				} else if(property.role >= 0) {
+					otherVertexProperties.push_back(property);
+				}
+			}
+
+			hasNormals = found[NX] && found[NY] && found[NZ];
 
-			stringstream ss(stringstream::in);
-			ss.str(line);
-			string garbage;
-			
-			if(startsWith(line, "element vertex")) {
-				ss >> garbage >> garbage >> verticesLeft;
-				mesh = new Mesh(filename, verticesLeft);
-				return;
+			// the indices are the list called vertex_indices, or failing
+			// that the first list
+			faceIndices = -1;
+			if(faces != NULL) {
+				for(size_t p = 0; p < faces->properties.size(); p++) {
+					const Property& property = faces->properties[p];
+					if(property.list && (faceIndices < 0 || property.name == "vertex_indices"
+							|| property.name == "vertex_index")) {
+						faceIndices = p;
+					}
+				}
+				if(faceIndices < 0) {
+					scanner.fail("faces need a list of vertex indices");
+				}
 			}
+		}
 
-			if(startsWith(line, "element face")) {
-				ss >> garbage >> garbage >> trianglesLeft;
-				mesh->startTriangles(trianglesLeft);
-				return;
+		// vertices [first, last) into their places in the mesh
+		void readVertices(Chunk& chunk, Mesh* mesh, unsigned first, unsigned last) {
+			Scanner& in = chunk.scanner;
+			float values[ROLES];
+			if(directVertices && (size_t)(in.end - in.cursor) / vertexStride < last - first) {
+				in.fail("file ended in the vertices");
+			}
+			for(unsigned i = first; i < last; i++) {
+				for(int role = 0; role < ROLES; role++) {
+					values[role] = 0;
+				}
+				if(directVertices) {
+					const unsigned char* vertex = (const unsigned char*)in.cursor;
+					for(int axis = 0; axis < 3; axis++) {
+						memcpy(&values[X + axis], vertex + positionOffsets[axis], sizeof(float));
+					}
+					vector<Property>::const_iterator property;
+					for(property = otherVertexProperties.begin(); property != otherVertexProperties.end(); ++property) {
+						values[property->role] = valueAt(vertex + property->offset, property->type);
+					}
+					in.cursor += vertexStride;
+				} else {
+					for(size_t p = 0; p < vertices->properties.size(); p++) {
+						const Property& property = vertices->properties[p];
+						if(property.role >= 0) {
+							values[property.role] = in.nextValue(property.type);
+						} else {
+							in.skipProperty(property);
+						}
+					}
+					if(in.format == ASCII) {
+						in.nextLine();
+					}
+				}
+				vec3 position(values[X], values[Y], values[Z]);
+				if(!chunk.anyVertices) {
+					chunk.min = chunk.max = position;
+					chunk.anyVertices = true;
+				}
+				for(int axis = 0; axis < 3; axis++) {
+					chunk.min[axis] = std::min(chunk.min[axis], position[axis]);
+					chunk.max[axis] = std::max(chunk.max[axis], position[axis]);
+				}
+				mesh->setVertex(i, vec4(position, 1));
+				if(hasNormals) {
+					mesh->setVertexNormal(i, vec4(values[NX], values[NY], values[NZ], 0));
+				}
 			}
+		}
 
-			if(verticesLeft > 0) {
-				vec4 vertex;
-				ss >> vertex.x >> vertex.y >> vertex.z;
-				vertex.w = 1;
-				mesh->addVertex(vertex);
-				verticesLeft--;
-				return;
+		// count faces onto the chunk's triangles, faces with more than
+		// three sides are split into a fan
+		void readFaces(Chunk& chunk, unsigned count) {
+			Scanner& in = chunk.scanner;
+			const Property& indexList = faces->properties[faceIndices];
+			// 32 bit indices in our byte order can be copied as they are
+			bool direct = in.format != ASCII && !in.swapBytes
+				&& (indexList.type == INT32 || indexList.type == UINT32);
+			vector<GLuint> polygon;
+			chunk.triangles.reserve(chunk.triangles.size() + count * 3);
+			for(unsigned i = 0; i < count; i++) {
+				for(size_t p = 0; p < faces->properties.size(); p++) {
+					if((int)p != faceIndices) {
+						in.skipProperty(faces->properties[p]);
+						continue;
+					}
+					unsigned sides = in.nextUnsigned(indexList.countType);
+					if(sides < 3) {
+						// nothing to draw, but its indices still need passing
+						for(unsigned side = 0; side < sides; side++) {
+							in.skipValue(indexList.type);
+						}
+						continue;
+					}
+					polygon.resize(sides);
+					if(direct) {
+						if((size_t)(in.end - in.cursor) / sizeof(GLuint) < sides) {
+							in.fail("file ended in the faces");
+						}
+						memcpy(&polygon[0], in.cursor, sides * sizeof(GLuint));
+						in.cursor += sides * sizeof(GLuint);
+					} else {
+						for(unsigned side = 0; side < sides; side++) {
+							polygon[side] = in.nextUnsigned(indexList.type);
+						}
+					}
+					for(unsigned side = 0; side < sides; side++) {
+						if(polygon[side] >= vertices->count) {
+							in.fail("vertex index out of range");
+						}
+					}
+					for(unsigned side = 1; side + 1 < sides; side++) {
+						chunk.triangles.push_back(polygon[0]);
+						chunk.triangles.push_back(polygon[side]);
+						chunk.triangles.push_back(polygon[side + 1]);
+					}
+				}
+				if(in.format == ASCII) {
+					in.nextLine();
+				}
 			}
+		}
 
-			if(trianglesLeft > 0) {
-				unsigned faces, a, b, c;
-				ss >> faces >> a >> b >> c;
-				mesh->addTriangle(a, b, c);
-				trianglesLeft--;
-				return;
+		// past count items of an element nothing is read from
+		void skipItems(Chunk& chunk, const Element& element, unsigned count) {
+			Scanner& in = chunk.scanner;
+			for(unsigned i = 0; i < count; i++) {
+				if(in.format == ASCII) {
+					in.nextLine();
+					continue;
+				}
+				for(size_t p = 0; p < element.properties.size(); p++) {
+					in.skipProperty(element.properties[p]);
+				}
 			}
+		}
 
-			throw ReaderException("Something went wrong");
+		// read the part of every element that falls in the chunk's items
+		void readChunk(Chunk& chunk, Mesh* mesh) {
+			unsigned long long elementFirst = 0;
+			for(size_t e = 0; e < elements.size(); e++) {
+				const Element& element = elements[e];
+				unsigned long long elementLast = elementFirst + element.count;
+				unsigned long long first = std::max(chunk.firstItem, elementFirst);
+				unsigned long long last = std::min(chunk.lastItem, elementLast);
+				if(first < last) {
+					if(&element == vertices) {
+						readVertices(chunk, mesh, first - elementFirst, last - elementFirst);
+					} else if(&element == faces) {
+						readFaces(chunk, last - first);
+					} else {
+						skipItems(chunk, element, last - first);
+					}
+				}
+				elementFirst = elementLast;
+			}
+		}
 
+		// split the body into chunks of whole lines, if it's ascii and big
+		// enough to be worth it, otherwise it's one chunk
+		// a prefix sum over the lines in each chunk gives where it starts
+		void splitBody(vector<Chunk>& chunks) {
+			unsigned long long items = 0;
+			for(size_t e = 0; e < elements.size(); e++) {
+				items += elements[e].count;
+			}
+			size_t bodySize = scanner.end - scanner.cursor;
+			unsigned numChunks = scanner.format == ASCII && bodySize >= minParallelBytes ? threads : 1;
+			chunks.resize(numChunks);
+			for(unsigned c = 0; c < numChunks; c++) {
+				Chunk& chunk = chunks[c];
+				chunk.scanner = scanner;
+				if(c > 0) {
+					const char* split = scanner.cursor + bodySize / numChunks * c;
+					split = std::max(split, chunks[c - 1].scanner.cursor);
+					const char* newline = (const char*)memchr(split, '\n', scanner.end - split);
+					chunk.scanner.cursor = newline != NULL ? newline + 1 : scanner.end;
+				}
+				chunk.anyVertices = false;
+				chunk.firstTriangle = 0;
+			}
+
+			vector<unsigned long long> lines(numChunks, 0);
+			if(numChunks > 1) {
+				parallelChunks(numChunks, numChunks, [&](unsigned c, size_t, size_t) {
+					const char* at = chunks[c].scanner.cursor;
+					const char* stop = c + 1 < numChunks ? chunks[c + 1].scanner.cursor : scanner.end;
+					while((at = (const char*)memchr(at, '\n', stop - at)) != NULL) {
+						lines[c]++;
+						at++;
+					}
+				});
+			}
+			unsigned long long line = 0;
+			for(unsigned c = 0; c < numChunks; c++) {
+				chunks[c].firstItem = std::min(line, items);
+				chunks[c].scanner.lineNum = scanner.lineNum + line;
+				line += lines[c];
+				chunks[c].lastItem = c + 1 < numChunks ? std::min(line, items) : items;
+			}
 		}
 
-		static bool startsWith(string str, string prefix) {
-			return str.substr(0, prefix.size()) == prefix;
+		// the first error any chunk had, if there was one
+		static void rethrow(const vector<Chunk>& chunks) {
+			for(size_t c = 0; c < chunks.size(); c++) {
+				if(!chunks[c].error.empty()) {
+					throw ReaderException(chunks[c].error);
+				}
+			}
+		}
+
+		void readBody(Mesh* mesh) {
+			vector<Chunk> chunks;
+			splitBody(chunks);
+			mesh->allocateVertexData(hasNormals);
+			parallelChunks(chunks.size(), chunks.size(), [&](unsigned c, size_t, size_t) {
+				try {
+					readChunk(chunks[c], mesh);
+				} catch(const ReaderException& e) {
+					chunks[c].error = e.what();
+				}
+			});
+			rethrow(chunks);
+
+			// bounds are the reduction of the chunks' bounds
+			vec3 min(0, 0, 0);
+			vec3 max(0, 0, 0);
+			bool anyVertices = false;
+			size_t numTriangles = 0;
+			for(size_t c = 0; c < chunks.size(); c++) {
+				Chunk& chunk = chunks[c];
+				if(chunk.anyVertices) {
+					for(int axis = 0; axis < 3; axis++) {
+						min[axis] = anyVertices ? std::min(min[axis], chunk.min[axis]) : chunk.min[axis];
+						max[axis] = anyVertices ? std::max(max[axis], chunk.max[axis]) : chunk.max[axis];
+					}
+					anyVertices = true;
+				}
+				chunk.firstTriangle = numTriangles;
+				numTriangles += chunk.triangles.size() / 3;
+			}
+			mesh->finishVertices(min, max);
+
+			// each chunk's triangles go in after the ones before it
+			mesh->startTriangles(numTriangles);
+			parallelChunks(chunks.size(), chunks.size(), [&](unsigned c, size_t, size_t) {
+				const vector<GLuint>& triangles = chunks[c].triangles;
+				for(size_t i = 0; i + 2 < triangles.size(); i += 3) {
+					mesh->setTriangle(chunks[c].firstTriangle + i / 3,
+							triangles[i], triangles[i + 1], triangles[i + 2]);
+				}
+			});
+		}
+
+	public:
+		PLYReader(const char* _filename) : file(_filename) {
+			filename = _filename;
+			threads = workerCount();
+		}
+
+		// number of threads reading big ascii files, 1 for serial
+		void setThreads(unsigned threads) {
+			this->threads = threads == 0 ? 1 : threads;
+		}
+
+		// returns a Mesh containing data from ply file
+		// caller is responsible for deleting Mesh when done
+		Mesh* read() {
+			scanner.filename = filename;
+			scanner.begin = scanner.cursor = file.getBytes();
+			scanner.end = scanner.begin + file.getSize();
+			scanner.format = ASCII;
+			scanner.swapBytes = false;
+			scanner.inBody = false;
+			scanner.lineNum = 0;
+			elements.clear();
+			readHeader();
+			readSchema();
+			scanner.inBody = true;
+
+			Mesh* mesh = new Mesh(filename, vertices->count);
+			try {
+				readBody(mesh);
+			} catch(const ReaderException& e) {
+				delete mesh;
+				throw;
+			}
+			return mesh;
 		}
 
 };
 
 #endif
-
@@ -0,0 +1,147 @@
+#ifndef __PARALLEL_H_
+#define __PARALLEL_H_
+
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// number of worker threads worth starting on this machine
+inline unsigned workerCount() {
+	unsigned count = std::thread::hardware_concurrency();
+	return count == 0 ? 1 : count;
+}
+
+// split [0, count) into numChunks contiguous ranges and call
+// func(chunk, begin, end) for each range on its own thread
+// the calling thread handles the first chunk itself, returns when all are done
+template<typename Func>
+void parallelChunks(size_t count, unsigned numChunks, Func func) {
+	if(numChunks == 0) {
+		numChunks = 1;
+	}
+	if(numChunks == 1 || count < numChunks) {
+		func(0, 0, count);
+		for(unsigned chunk = 1; chunk < numChunks; chunk++) {
+			func(chunk, count, count); // keep chunk bookkeeping consistent
+		}
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	size_t chunkSize = count / numChunks;
+	for(unsigned chunk = 1; chunk < numChunks; chunk++) {
+		size_t begin = chunk * chunkSize;
+		size_t end = chunk == numChunks - 1 ? count : begin + chunkSize;
+		workers.push_back(std::thread(func, chunk, begin, end));
+	}
+	func(0, 0, chunkSize);
+	for(std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it) {
+		it->join();
+	}
+}
+
+// call func(i) for every i in [0, count) on numThreads threads
+// items are handed out one at a time, so uneven items still balance
+template<typename Func>
+void parallelFor(size_t count, unsigned numThreads, Func func) {
+	std::atomic<size_t> nextItem(0);
+	parallelChunks(numThreads, numThreads, [&](unsigned, size_t, size_t) {
+		for(size_t i = nextItem++; i < count; i = nextItem++) {
+			func(i);
+		}
+	});
+}
+
+// threads that stay around between calls to run(), for work that's handed
+// out many times a frame where starting threads each time would show
+class WorkerPool {
+	private:
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable wake; // a new job, or stopping
+		std::condition_variable finished; // every worker is done with the job
+		const std::function<void(size_t)>* job;
+		size_t jobCount;
+		std::atomic<size_t> nextItem;
+		unsigned generation; // bumped for every job
+		unsigned busy; // workers still on the current job
+		bool stopping;
+
+		void work() {
+			for(size_t i = nextItem++; i < jobCount; i = nextItem++) {
+				(*job)(i);
+			}
+		}
+
+		void workerLoop() {
+			unsigned seen = 0;
+			std::unique_lock<std::mutex> lock(mutex);
+			while(true) {
+				wake.wait(lock, [&]() { return stopping || generation != seen; });
+				if(stopping) {
+					return;
+				}
+				seen = generation;
+				lock.unlock();
+				work();
+				lock.lock();
+				if(--busy == 0) {
+					finished.notify_all();
+				}
+			}
+		}
+
+	public:
+		// the thread calling run() works too, so numThreads - 1 are started
+		WorkerPool(unsigned numThreads = workerCount()) {
+			job = NULL;
+			jobCount = 0;
+			nextItem = 0;
+			generation = 0;
+			busy = 0;
+			stopping = false;
+			for(unsigned i = 1; i < numThreads; i++) {
+				threads.push_back(std::thread(&WorkerPool::workerLoop, this));
+			}
+		}
+
+		~WorkerPool() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for(std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it) {
+				it->join();
+			}
+		}
+
+		unsigned size() {
+			return threads.size() + 1;
+		}
+
+		// call func(i) for every i in [0, count), items handed out one at a
+		// time, returns when all are done
+		void run(size_t count, const std::function<void(size_t)>& func) {
+			if(count == 0) {
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				job = &func;
+				jobCount = count;
+				nextItem = 0;
+				busy = threads.size();
+				generation++;
+			}
+			wake.notify_all();
+			work();
+			std::unique_lock<std::mutex> lock(mutex);
+			finished.wait(lock, [&]() { return busy == 0; });
+		}
+};
+
+#endif
@@ -1,4 +1,7 @@
 
+#ifndef __READEREXCEPTION_H_
+#define __READEREXCEPTION_H_
+
 #include <string>
 #include <stdexcept>
 
@@ -18,3 +21,4 @@ struct ReaderException : public std::runtime_error {
 		}
 };
 
+#endif
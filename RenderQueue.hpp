@@ -0,0 +1,338 @@
+#ifndef __RENDERQUEUE_H_
+#define __RENDERQUEUE_H_
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <string.h>
+
+#include "Angel.h"
+#include "Mesh.hpp"
+#include "ShaderProgram.hpp"
+#include "RenderStats.hpp"
+
+using std::vector;
+
+// one draw call recorded for later, with all the state it needs
+struct DrawItem {
+	GLuint vao; // 0 for whatever vertex array is bound when the queue is submitted
+	GLuint texture; // 0 if untextured
+	bool useVertexColor;
+	vec4 color;
+	mat4 model;
+	mat4 decode; // takes stored positions to model space
+	GLuint instanceBuffer; // per-instance model matrices, 0 to use model instead
+	GLintptr instanceOffset;
+	GLuint divisor; // instances drawn from each matrix in instanceBuffer
+	GLint first; // first vertex, or the base vertex added to indices
+	GLsizei count; // vertices, or indices
+	GLsizei instances;
+	GLenum indexType; // 0 to draw vertices in order instead of by index
+	GLintptr indexOffset; // bytes into the bound element buffer
+	Mesh* mesh; // whole mesh drawn, for drawing without GL, NULL if not a mesh
+
+	DrawItem(GLint first, GLsizei count, GLsizei instances = 1) {
+		init(first, count, instances);
+	}
+
+	// all of a mesh's triangles, indexed if the mesh has been
+	DrawItem(Mesh* mesh, GLsizei instances = 1) {
+		init(mesh->getDrawOffset(), mesh->getNumPoints(), instances);
+		vao = mesh->getVertexArray();
+		decode = mesh->getLayout().getDecodeMatrix();
+		this->mesh = mesh;
+		if(mesh->isIndexed()) {
+			indexType = mesh->getIndexType();
+			indexOffset = mesh->getIndexOffset();
+		}
+	}
+
+	void init(GLint first, GLsizei count, GLsizei instances) {
+		vao = 0;
+		texture = 0;
+		useVertexColor = false;
+		color = vec4(1, 1, 1, 1);
+		instanceBuffer = 0;
+		instanceOffset = 0;
+		divisor = 1;
+		this->first = first;
+		this->count = count;
+		this->instances = instances;
+		indexType = 0;
+		indexOffset = 0;
+		mesh = NULL;
+	}
+};
+
+// collects a frame's draw items, then sorts them by the state they need
+// so that vertex array, texture and uniform changes happen as rarely as
+// possible before submitting them all in one pass
+// there's only one shader program, so program switches aren't part of the key
+class RenderQueue {
+	private:
+		ShaderProgram* program;
+		GLint modelLoc;
+		GLint decodeLoc;
+		GLint colorLoc;
+		GLint useTextureLoc;
+		GLint useVertexColorLoc;
+		GLint useInstancingLoc;
+		GLint instanceLoc; // first of the four columns of instance_matrix
+
+		vector<DrawItem> items;
+		vector<std::pair<unsigned long long, size_t> > order; // sort key, item
+		vector<vec4> palette; // distinct colors this frame, to put them in keys
+		bool sorting;
+
+		// state left behind by the last item submitted
+		struct State {
+			bool valid; // false before the first item, when everything is unknown
+			GLuint vao;
+			GLuint texture;
+			bool useVertexColor;
+			vec4 color;
+			bool instanced;
+			GLuint instanceBuffer;
+			GLintptr instanceOffset;
+			GLuint divisor;
+			mat4 model;
+			mat4 decode;
+		};
+
+		static bool same(const vec4& a, const vec4& b) {
+			return memcmp((const GLfloat*)a, (const GLfloat*)b, sizeof(vec4)) == 0;
+		}
+
+		static bool same(const mat4& a, const mat4& b) {
+			return memcmp((const GLfloat*)a, (const GLfloat*)b, sizeof(mat4)) == 0;
+		}
+
+		unsigned colorIndex(const vec4& color) {
+			for(size_t i = 0; i < palette.size(); i++) {
+				if(same(palette[i], color)) {
+					return i;
+				}
+			}
+			palette.push_back(color);
+			return palette.size() - 1;
+		}
+
+		// most expensive state in the highest bits: vertex array, then
+		// instancing, texture and the color uniforms
+		unsigned long long sortKey(const DrawItem& item) {
+			unsigned long long key = (unsigned long long)(item.vao & 0xfff) << 52;
+			key |= (unsigned long long)(item.instanceBuffer != 0) << 51;
+			key |= (unsigned long long)(item.texture & 0xfff) << 39;
+			key |= (unsigned long long)item.useVertexColor << 38;
+			if(!item.useVertexColor) {
+				key |= (unsigned long long)(colorIndex(item.color) & 0x3fffff) << 16;
+			}
+			return key;
+		}
+
+		void setDivisor(GLuint index, GLuint divisor) {
+			if(GLEW_VERSION_3_3) {
+				glVertexAttribDivisor(index, divisor);
+			} else {
+				glVertexAttribDivisorARB(index, divisor);
+			}
+		}
+
+		void setInstanceArrays(bool enable) {
+			for(int column = 0; column < 4; column++) {
+				if(enable) {
+					glEnableVertexAttribArray(instanceLoc + column);
+				} else {
+					glDisableVertexAttribArray(instanceLoc + column);
+				}
+			}
+		}
+
+		// bring state up to what item needs, returns how many changes that took
+		// only counts them unless issue is set
+		unsigned transition(State& state, const DrawItem& item, GLuint defaultVao, bool issue) {
+			unsigned changes = 0;
+			bool instanced = item.instanceBuffer != 0;
+			if(!state.valid || item.vao != state.vao) {
+				if(issue && state.valid && state.instanced) {
+					setInstanceArrays(false); // belong to the old vertex array
+					program->setUniform(useInstancingLoc, false);
+				}
+				if(issue) {
+					glBindVertexArray(item.vao != 0 ? item.vao : defaultVao);
+				}
+				state.vao = item.vao;
+				state.instanced = false;
+				changes++;
+			}
+			if(!state.valid || item.texture != state.texture) {
+				if(issue) {
+					if(item.texture != 0) {
+						glBindTexture(GL_TEXTURE_2D, item.texture);
+					}
+					program->setUniform(useTextureLoc, item.texture != 0);
+				}
+				state.texture = item.texture;
+				changes++;
+			}
+			if(!state.valid || item.useVertexColor != state.useVertexColor) {
+				if(issue) {
+					program->setUniform(useVertexColorLoc, item.useVertexColor);
+				}
+				state.useVertexColor = item.useVertexColor;
+				changes++;
+			}
+			if(!state.valid || !same(item.decode, state.decode)) {
+				if(issue) {
+					program->setUniform(decodeLoc, item.decode);
+				}
+				state.decode = item.decode;
+				changes++;
+			}
+			if(!item.useVertexColor && (!state.valid || !same(item.color, state.color))) {
+				if(issue) {
+					program->setUniform(colorLoc, item.color);
+				}
+				state.color = item.color;
+				changes++;
+			}
+			if(!state.valid || instanced != state.instanced) {
+				if(issue) {
+					program->setUniform(useInstancingLoc, instanced);
+					setInstanceArrays(instanced);
+				}
+				state.instanced = instanced;
+				state.instanceBuffer = 0;
+				changes++;
+			}
+			if(instanced) {
+				if(item.instanceBuffer != state.instanceBuffer
+						|| item.instanceOffset != state.instanceOffset
+						|| item.divisor != state.divisor) {
+					if(issue) {
+						glBindBuffer(GL_ARRAY_BUFFER, item.instanceBuffer);
+						for(int column = 0; column < 4; column++) {
+							GLuint loc = instanceLoc + column;
+							glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, sizeof(mat4),
+									BUFFER_OFFSET(item.instanceOffset + column * sizeof(vec4)));
+							setDivisor(loc, item.divisor);
+						}
+					}
+					state.instanceBuffer = item.instanceBuffer;
+					state.instanceOffset = item.instanceOffset;
+					state.divisor = item.divisor;
+					changes++;
+				}
+			} else if(!state.valid || !same(item.model, state.model)) {
+				if(issue) {
+					program->setUniform(modelLoc, item.model);
+				}
+				state.model = item.model;
+				changes++;
+			}
+			state.valid = true;
+			return changes;
+		}
+
+		// state changes needed to draw everything in the order given
+		unsigned countChanges(bool sorted) {
+			State state;
+			state.valid = false;
+			unsigned changes = 0;
+			for(size_t i = 0; i < items.size(); i++) {
+				changes += transition(state, items[sorted ? order[i].second : i], 0, false);
+			}
+			return changes;
+		}
+
+		// sort the items and decide whether to use that order, returns true if so
+		bool sortItems() {
+			std::sort(order.begin(), order.end());
+			unsigned unsortedChanges = countChanges(false);
+			unsigned sortedChanges = countChanges(true);
+			// the key order isn't always better for a handful of items
+			bool sorted = sorting && sortedChanges < unsortedChanges;
+			renderStats.stateChanges += sorted ? sortedChanges : unsortedChanges;
+			if(sorted) {
+				renderStats.stateChangesSaved += unsortedChanges - sortedChanges;
+			}
+			return sorted;
+		}
+
+	public:
+		RenderQueue(ShaderProgram* program) {
+			this->program = program;
+			modelLoc = program->uniform("model_matrix");
+			decodeLoc = program->uniform("position_decode");
+			colorLoc = program->uniform("inColor");
+			useTextureLoc = program->uniform("useTexture");
+			useVertexColorLoc = program->uniform("useVertexColor");
+			useInstancingLoc = program->uniform("useInstancing");
+			instanceLoc = program->attribute("instance_matrix");
+			sorting = true;
+		}
+
+		void add(const DrawItem& item) {
+			items.push_back(item);
+			order.push_back(std::make_pair(sortKey(item), items.size() - 1));
+		}
+
+		// draw everything added since the last submit and empty the queue
+		// ties keep the order they were added in, and the added order is
+		// used as is if sorting wouldn't save anything
+		void submit() {
+			GLint defaultVao, oldBuffer;
+			glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &defaultVao);
+			glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &oldBuffer);
+
+			bool sorted = sortItems();
+			State state;
+			state.valid = false;
+			for(size_t i = 0; i < items.size(); i++) {
+				const DrawItem& item = items[sorted ? order[i].second : i];
+				transition(state, item, defaultVao, true);
+				if(item.indexType != 0) {
+					glDrawElementsInstancedBaseVertex(GL_TRIANGLES, item.count, item.indexType,
+							BUFFER_OFFSET(item.indexOffset), item.instances, item.first);
+				} else {
+					glDrawArraysInstanced(GL_TRIANGLES, item.first, item.count, item.instances);
+				}
+				renderStats.countDraw(item.count, item.instances);
+			}
+
+			// leave things the way the rest of the program expects
+			if(state.valid && state.instanced) {
+				setInstanceArrays(false);
+				program->setUniform(useInstancingLoc, false);
+			}
+			program->setUniform(useVertexColorLoc, false);
+			glBindVertexArray(defaultVao);
+			glBindBuffer(GL_ARRAY_BUFFER, oldBuffer);
+
+			items.clear();
+			order.clear();
+			palette.clear();
+		}
+
+		// hand over everything added since the last submit, in the order
+		// submit would draw it, and empty the queue
+		// for drawing without GL, so no state is touched
+		void drain(vector<DrawItem>& out) {
+			bool sorted = sortItems();
+			out.clear();
+			for(size_t i = 0; i < items.size(); i++) {
+				out.push_back(items[sorted ? order[i].second : i]);
+			}
+			items.clear();
+			order.clear();
+			palette.clear();
+		}
+
+		// switch between sorted submission and drawing in the order added
+		void toggleSorting() {
+			sorting = !sorting;
+			cout << "render queue sorting " << (sorting ? "on" : "off") << endl;
+		}
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef __RENDERSTATS_H_
+#define __RENDERSTATS_H_
+
+#include "Angel.h"
+
+using std::cout;
+using std::endl;
+
+// counts the work submitted to GL during one frame
+struct RenderStats {
+	unsigned long drawCalls;
+	unsigned long long triangles;
+	unsigned long uniformUploads;
+	unsigned long uniformsSkipped; // uploads that wouldn't have changed anything
+	unsigned long stateChanges;
+	unsigned long stateChangesSaved; // by sorting the render queue
+	unsigned long objectsVisible;
+	unsigned long objectsCulled; // outside the view along with their shadows
+	unsigned long branchesCulled; // tree branches skipped inside visible trees
+
+	RenderStats() {
+		reset();
+	}
+
+	void reset() {
+		drawCalls = 0;
+		triangles = 0;
+		uniformUploads = 0;
+		uniformsSkipped = 0;
+		stateChanges = 0;
+		stateChangesSaved = 0;
+		objectsVisible = 0;
+		objectsCulled = 0;
+		branchesCulled = 0;
+	}
+
+	// record one draw call of count vertices as triangles, instances times
+	void countDraw(GLsizei count, GLsizei instances = 1) {
+		drawCalls++;
+		triangles += (unsigned long long)(count / 3) * instances;
+	}
+
+	void print() {
+		cout << "draw calls=" << drawCalls << ", triangles=" << triangles
+			<< ", uniform uploads=" << uniformUploads
+			<< ", skipped=" << uniformsSkipped << endl;
+		cout << "state changes=" << stateChanges
+			<< ", saved by sorting=" << stateChangesSaved << endl;
+		cout << "objects visible=" << objectsVisible
+			<< ", culled=" << objectsCulled
+			<< ", tree branches culled=" << branchesCulled << endl;
+	}
+};
+
+// stats for the frame being drawn, Scene::render resets it at the start of each frame
+static RenderStats renderStats;
+
+#endif
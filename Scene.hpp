@@ -2,8 +2,14 @@
 #ifndef __SCENE_H_
 #define __SCENE_H_
 
+#include <map>
+
 #include "LSystemRenderer.hpp"
-#include "bmpread.c"
+#include "BufferArena.hpp"
+#include "SoftwareRasterizer.hpp"
+#include "AssetLoader.hpp"
+
+using std::cerr;
 
 // defines a camera whose coordinate system is along u/v/n axes
 // (rather than x/y/z) at eye position
@@ -47,6 +53,10 @@ class Camera {
 			return viewMatrix;
 		}
 
+		vec3 getEye() {
+			return eye;
+		}
+
 		void slide(vec3 delta) {
 			mat3 uvn = transpose(mat3(u, v, n));
 			eye += uvn * delta;
@@ -100,14 +110,41 @@ class Scene {
 		bool showShadows;
 		bool useExponentialFog;
 		Camera camera;
-		GLuint program;
+		ShaderProgram* program;
+		GLint projLoc;
+		GLint shadowCopiesLoc;
+		RenderQueue queue;
+		Culler culler;
 		vector<Mesh*> meshes;
-		Mesh* cow;
+		Mesh* cow; // NULL until loaded
 		Mesh* car;
 		Mesh* ground;
+		// big meshes still being read, and where each goes once it's in
+		vector<std::pair<Mesh**, std::shared_future<Mesh*> > > loading;
+		bool buffered; // bufferPoints has been called, so new meshes are uploaded
+		bool formatOverridden;
+		VertexLayout::PositionFormat positionFormat; // if overridden
 		GLuint textures[2];
 		bool showGrass;
 
+		// every mesh's vertices and indices are ranges of these, so meshes
+		// can come and go without re-uploading the others
+		BufferArena* vertexArena; // NULL without GL
+		BufferArena* indexArena;
+		struct MeshRanges {
+			BufferRange* vertices;
+			BufferRange* indices; // NULL if not indexed
+		};
+		map<Mesh*, MeshRanges> resident; // meshes that can be drawn
+		bool indexMeshes;
+		bool weldMeshes;
+		// evicting defragments once this much of the free space is in pieces
+		static constexpr float maxFragmentation = 0.5;
+
+		// draws instead of GL when the program is a software one
+		SoftwareRasterizer* rasterizer;
+		vector<DrawItem> drawItems; // a frame's queue, for the rasterizer
+
 		void updatePerspective() {
 			if(screenHeight == 0) {
 				perspective = mat4(); // don't want to divide by zero...
@@ -117,22 +154,88 @@ class Scene {
 				* Perspective(90, (float)screenWidth/screenHeight, 0.0000001, 100000);
 		}
 
-		// returns next empty space in buffer
-		GLuint bufferMeshes(GLuint bufferStart, vector<Mesh*>* meshes) {
-			for (vector<Mesh*>::const_iterator i = meshes->begin(); i != meshes->end(); ++i) {
-				Mesh* mesh = *i;
-				GLsizeiptr bytes = mesh->getNumBytes();
-				mesh->setDrawOffset(bufferStart / sizeof(mesh->getPoints()[0]));
-				glBufferSubData(GL_ARRAY_BUFFER, bufferStart, bytes, mesh->getPoints());
-				bufferStart += bytes;
+		// point a resident mesh's vertex array at where its data is now
+		void bindMesh(Mesh* mesh) {
+			MeshRanges& ranges = resident[mesh];
+			GLuint vao = mesh->getVertexArray();
+			if(vao == 0) {
+				glGenVertexArrays(1, &vao);
+				mesh->setVertexArray(vao);
+			}
+			GLint oldVao, oldBuffer;
+			glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &oldVao);
+			glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &oldBuffer);
+			glBindVertexArray(vao);
+			glBindBuffer(GL_ARRAY_BUFFER, vertexArena->getBuffer());
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexArena->getBuffer());
+			mesh->getLayout().setPointers(program->attribute("vPosition"), -1,
+					ranges.vertices->offset);
+			mesh->setDrawOffset(0); // the pointers start at the mesh
+			if(ranges.indices != NULL) {
+				mesh->setIndexOffset(ranges.indices->offset);
+			}
+			glBindVertexArray(oldVao);
+			glBindBuffer(GL_ARRAY_BUFFER, oldBuffer);
+		}
+
+		void prepareMesh(Mesh* mesh) {
+			// the mesh cache may have indexed it already
+			if(indexMeshes && !mesh->isIndexedWith(weldMeshes, true)) {
+				mesh->buildIndexed(weldMeshes, true);
+			}
+		}
+
+		// copy a prepared mesh into the arenas, in place of its old data
+		// without GL, the rasterizer reads the mesh itself
+		void storeMesh(Mesh* mesh) {
+			releaseRanges(mesh);
+			MeshRanges ranges;
+			if(rasterizer != NULL) {
+				ranges.vertices = ranges.indices = NULL;
+				resident[mesh] = ranges;
+				return;
+			}
+			GLsizeiptr bytes = mesh->getNumBytes();
+			vector<char> packed(bytes);
+			mesh->packBufferPoints(&packed[0]);
+			ranges.vertices = vertexArena->allocate(bytes);
+			vertexArena->upload(ranges.vertices, &packed[0], bytes);
+
+			ranges.indices = NULL;
+			if(mesh->isIndexed()) {
+				bytes = mesh->getIndexBytes();
+				packed.resize(bytes);
+				mesh->copyIndices(&packed[0]);
+				ranges.indices = indexArena->allocate(bytes);
+				indexArena->upload(ranges.indices, &packed[0], bytes);
+			}
+			resident[mesh] = ranges;
+			bindMesh(mesh);
+		}
+
+		// give back a mesh's space in the arenas, if it has any
+		// returns false if it didn't
+		bool releaseRanges(Mesh* mesh) {
+			map<Mesh*, MeshRanges>::iterator found = resident.find(mesh);
+			if(found == resident.end()) {
+				return false;
+			}
+			if(rasterizer == NULL) {
+				vertexArena->release(found->second.vertices);
+				indexArena->release(found->second.indices);
 			}
-			return bufferStart;
+			resident.erase(found);
+			return true;
 		}
 
 		void assignTexture(string path, GLuint texName) {
-			bmpread_t bitmap;
-			if(!bmpread(path.c_str(), 0, &bitmap)) {
-				throw runtime_error("failed to load texture: " + path);
+			bmpread_t* loaded = assetLoader.takeBitmap(path).get();
+			bmpread_t bitmap = *loaded;
+			delete loaded;
+			if(rasterizer != NULL) {
+				rasterizer->setTexture(texName, bitmap.width, bitmap.height, bitmap.rgb_data);
+				bmpread_free(&bitmap);
+				return;
 			}
 			glBindTexture(GL_TEXTURE_2D, texName);
 
@@ -147,15 +250,15 @@ class Scene {
 		}
 
 		void setUpTextures() {
-			glActiveTexture(GL_TEXTURE0);
-			glGenTextures(2, textures);
-
-			glUniform1i(glGetUniformLocation(program, "texture"), 0);
+			if(rasterizer != NULL) {
+				textures[0] = 1;
+				textures[1] = 2;
+			} else {
+				glActiveTexture(GL_TEXTURE0);
+				glGenTextures(2, textures);
+			}
 
-			// just reuse the vertex as a texture coord
-			GLuint vTexCoord = glGetAttribLocation(program, "vTexCoord");
-			glEnableVertexAttribArray(vTexCoord);
-			glVertexAttribPointer(vTexCoord, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+			program->setUniform(program->uniform("texture"), 0);
 
 			assignTexture("textures/grass.bmp", textures[0]);
 			assignTexture("textures/stones.bmp", textures[1]);
@@ -163,38 +266,46 @@ class Scene {
 			toggleGrass();
 		}
 
-		// use the shadow matrix in the shader, or not (ignored if !showShadows)
-		void setUseShadow(bool use) {
-			static vec4 oldColor;
-			static bool oldUseState = false;
-			// need to backup/restore old color being used
-			if(use != oldUseState) {
-				GLuint colorLoc = glGetUniformLocationARB(program, "inColor");
-				if(use) {
-					glGetUniformfv(program, colorLoc, oldColor);
-					glUniform4fv(colorLoc, 1, vec4(0, 0, 0, 1)); // render shadow as black
-				} else {
-					glUniform4fv(colorLoc, 1, oldColor);
-				}
-				oldUseState = use;
+		// queue a white mesh, along with its shadow as a second instance
+		// if shadows are on, unless neither can be seen
+		void drawWithShadow(Mesh* mesh, mat4 model) {
+			if(resident.find(mesh) == resident.end()) {
+				return;
+			}
+			BoundingBox* box = mesh->getBoundingBox();
+			if(!culler.isVisible(model, box->getMin(), box->getMax())) {
+				return;
 			}
-			GLuint shadowLoc = glGetUniformLocationARB(program, "shadow_matrix");
-			glUniformMatrix4fv(shadowLoc, 1, GL_TRUE, use && showShadows ? shadow : mat4());
+			DrawItem item(mesh, showShadows ? 2 : 1);
+			item.model = model;
+			queue.add(item);
 		}
 
 	public:
 		LSystemRenderer& lsysRenderer;
 
-		Scene(GLuint program, LSystemRenderer& lr):lsysRenderer(lr) {
+		Scene(ShaderProgram* program, LSystemRenderer& lr):queue(program), lsysRenderer(lr) {
 			this->program = program;
+			projLoc = program->uniform("projection_matrix");
+			shadowCopiesLoc = program->uniform("shadowCopies");
+			if(program->isSoftware()) {
+				rasterizer = new SoftwareRasterizer(program);
+				vertexArena = indexArena = NULL;
+			} else {
+				rasterizer = NULL;
+				vertexArena = new BufferArena(0, 4);
+				indexArena = new BufferArena(0, 4);
+			}
+			indexMeshes = true;
+			weldMeshes = true;
+			buffered = false;
+			formatOverridden = false;
 
-			PLYReader cowReader("meshes/cow.ply");
-			cow = cowReader.read();
-			meshes.push_back(cow);
-
-			PLYReader carReader("meshes/big_porsche.ply");
-			car = carReader.read();
-			meshes.push_back(car);
+			// drawn once they've been read, see updateAssets
+			startLoading();
+			cow = car = NULL;
+			loading.push_back(std::make_pair(&cow, assetLoader.takeMesh("meshes/cow.ply")));
+			loading.push_back(std::make_pair(&car, assetLoader.takeMesh("meshes/big_porsche.ply")));
 
 			// our randomly placed trees and floor plane will be in this volume
 			vec3 max(10, 0, 10);
@@ -216,6 +327,8 @@ class Scene {
 				}
 				ground->addTriangle(pointIndex, pointIndex + 1, pointIndex + 2);
 			}
+			// full floats, since positions are its texture coordinates too
+			ground->setLayout(VertexLayout(VertexLayout::POSITION_FLOAT3));
 			meshes.push_back(ground);
 
 			setUpTextures();
@@ -232,68 +345,163 @@ class Scene {
 			m[3].y = -1.0 / (light.y - 0.01);
 			m[3].w = 0;
 			shadow = Translate(light) * m * Translate(-light);
+			program->setUniform(program->uniform("shadow_matrix"), shadow);
 		}
 
-		void bufferPoints() {
-			GLsizeiptr totalBytes = lsysRenderer.getTotalBytes();
-			for (vector<Mesh*>::const_iterator i = meshes.begin(); i != meshes.end(); ++i) {
-				totalBytes += (*i)->getNumBytes();
+		// upload every mesh, indexed unless told not to, with vertices at
+		// the same position welded together unless told not to
+		void bufferPoints(bool indexed = true, bool weld = true) {
+			indexMeshes = indexed;
+			weldMeshes = weld;
+			buffered = true;
+			GLsizeiptr unindexedBytes = 0;
+			GLsizeiptr float4Bytes = 0;
+			GLsizeiptr vertexBytes = 0;
+			GLsizeiptr indexBytes = 0;
+			double trianglesReordered = 0;
+			double missesBefore = 0;
+			double missesAfter = 0;
+			vector<Mesh*>* groups[2] = {&meshes, lsysRenderer.getMeshes()};
+			for(int group = 0; group < 2; group++) {
+				for (vector<Mesh*>::const_iterator i = groups[group]->begin(); i != groups[group]->end(); ++i) {
+					unindexedBytes += (*i)->getNumPoints() * sizeof(vec4);
+					prepareMesh(*i);
+					float4Bytes += (*i)->getNumBufferPoints() * sizeof(vec4);
+					vertexBytes += ((*i)->getNumBytes() + 3) & ~3;
+					if((*i)->isIndexed()) {
+						indexBytes += ((*i)->getIndexBytes() + 3) & ~3;
+						double triangles = (*i)->getNumPoints() / 3;
+						trianglesReordered += triangles;
+						missesBefore += triangles * (*i)->getMissRatioBefore();
+						missesAfter += triangles * (*i)->getMissRatioAfter();
+					}
+				}
 			}
 
-			glBufferData(GL_ARRAY_BUFFER, totalBytes, NULL, GL_STATIC_DRAW);
-
-			GLuint bufferStart = bufferMeshes(0, &meshes);
-			bufferStart = bufferMeshes(bufferStart, lsysRenderer.getMeshes());
-
-			GLuint posLoc = glGetAttribLocation(program, "vPosition");
-			glEnableVertexAttribArray(posLoc);
-			glVertexAttribPointer(posLoc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+			// room for everything at once, rather than growing mesh by mesh
+			if(rasterizer == NULL) {
+				vertexArena->reserve(vertexArena->getUsedBytes() + vertexBytes);
+				indexArena->reserve(indexArena->getUsedBytes() + indexBytes);
+			}
+			for(int group = 0; group < 2; group++) {
+				for (vector<Mesh*>::const_iterator i = groups[group]->begin(); i != groups[group]->end(); ++i) {
+					storeMesh(*i);
+				}
+			}
+			defragment();
+
+			cout << "mesh buffers: " << vertexBytes / 1024 << " KB of vertices ("
+				<< float4Bytes / 1024 << " KB as vec4s), " << indexBytes / 1024 << " KB of indices ("
+				<< unindexedBytes / 1024 << " KB unindexed)" << endl;
+			if(trianglesReordered > 0) {
+				cout << "vertex cache misses per triangle: " << missesBefore / trianglesReordered
+					<< " before reordering, " << missesAfter / trianglesReordered << " after" << endl;
+			}
 		}
 
-		void display() {
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		// upload one mesh, or upload it again after it's changed, without
+		// touching any other mesh's data
+		void uploadMesh(Mesh* mesh) {
+			prepareMesh(mesh);
+			storeMesh(mesh);
+		}
 
-			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-			glEnable(GL_DEPTH_TEST);
-			GLuint projLoc = glGetUniformLocationARB(program, "projection_matrix");
-			glUniformMatrix4fv(projLoc, 1, GL_TRUE, perspective * camera.getViewMatrix());
-			setUseShadow(false);
+		// free a mesh's buffer space, it isn't drawn until uploaded again
+		void evictMesh(Mesh* mesh) {
+			if(!releaseRanges(mesh)) {
+				return;
+			}
+			if(rasterizer != NULL) {
+				return;
+			}
+			GLuint vao = mesh->getVertexArray();
+			glDeleteVertexArrays(1, &vao);
+			mesh->setVertexArray(0);
+			if(vertexArena->getFragmentation() > maxFragmentation
+					|| indexArena->getFragmentation() > maxFragmentation) {
+				defragment();
+			}
+		}
 
-			if(lsysRenderer.forestMode()) {
-				GLuint colorLoc = glGetUniformLocationARB(program, "inColor");
-				GLuint modelLoc = glGetUniformLocationARB(program, "model_matrix");
-				GLuint useTextureLoc = glGetUniformLocationARB(program, "useTexture");
+		// pack the mesh arenas and re-point the meshes that moved
+		void defragment() {
+			if(rasterizer != NULL) {
+				return;
+			}
+			bool moved = vertexArena->defragment();
+			moved = indexArena->defragment() || moved;
+			if(!moved) {
+				return;
+			}
+			for(map<Mesh*, MeshRanges>::iterator i = resident.begin(); i != resident.end(); ++i) {
+				bindMesh(i->first);
+			}
+		}
 
-				glUniform1i(useTextureLoc, true);
-				glUniform4fv(colorLoc, 1, vec4(0.5, 1, 0.5, 1));
-				glUniformMatrix4fv(modelLoc, 1, GL_TRUE, mat4());
-				glDrawArrays(GL_TRIANGLES, ground->getDrawOffset(), ground->getNumPoints());
-				glUniform1i(useTextureLoc, false);
+		// store every mesh's positions this way instead of its own choice,
+		// uploaded meshes are uploaded again
+		void setPositionFormat(VertexLayout::PositionFormat format) {
+			formatOverridden = true;
+			positionFormat = format;
+			vector<Mesh*>* groups[2] = {&meshes, lsysRenderer.getMeshes()};
+			for(int group = 0; group < 2; group++) {
+				for (vector<Mesh*>::const_iterator i = groups[group]->begin(); i != groups[group]->end(); ++i) {
+					(*i)->setLayout(VertexLayout(format));
+					if(resident.find(*i) != resident.end()) {
+						storeMesh(*i);
+					}
+				}
+			}
+			defragment();
+		}
 
-				glUniform4fv(colorLoc, 1, vec4(1, 1, 1, 1));
+		// draw a frame into whatever framebuffer is bound
+		void render() {
+			renderStats.reset();
+			if(rasterizer != NULL) {
+				rasterizer->clear();
+			} else {
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+				glEnable(GL_DEPTH_TEST);
+			}
+			mat4 viewProjection = perspective * camera.getViewMatrix();
+			program->setUniform(projLoc, viewProjection);
+			program->setUniform(shadowCopiesLoc, showShadows);
+			// 90 degree field of view, so one unit away spans 2 units of height
+			float pixelScale = screenHeight / 2.0;
+			culler.update(viewProjection, shadow, showShadows, camera.getEye(), pixelScale);
 
-				glUniformMatrix4fv(modelLoc, 1, GL_TRUE, Scale(3));
-				glDrawArrays(GL_TRIANGLES, cow->getDrawOffset(), cow->getNumPoints());
-				setUseShadow(true); // draw again with shadows
-				glDrawArrays(GL_TRIANGLES, cow->getDrawOffset(), cow->getNumPoints());
-				setUseShadow(false);
+			if(lsysRenderer.forestMode()) {
+				BoundingBox* groundBox = ground->getBoundingBox();
+				if(culler.isVisible(groundBox->getMin(), groundBox->getMax())) {
+					DrawItem groundItem(ground);
+					groundItem.texture = showGrass ? textures[0] : textures[1];
+					groundItem.color = vec4(0.5, 1, 0.5, 1);
+					queue.add(groundItem);
+				}
 
+				drawWithShadow(cow, Scale(3));
 
-				float yAdjust = -1 * car->getBoundingBox()->getMin().y;
-				glUniformMatrix4fv(modelLoc, 1, GL_TRUE, RotateY(-60) * Translate(-25, yAdjust, 0));
-				glDrawArrays(GL_TRIANGLES, car->getDrawOffset(), car->getNumPoints());
-				setUseShadow(true);
-				glDrawArrays(GL_TRIANGLES, car->getDrawOffset(), car->getNumPoints());
-				setUseShadow(false);
+				if(car != NULL) {
+					float yAdjust = -1 * car->getBoundingBox()->getMin().y;
+					drawWithShadow(car, RotateY(-60) * Translate(-25, yAdjust, 0));
+				}
 			}
 
-			lsysRenderer.display();
-			setUseShadow(true);
-			lsysRenderer.display(false); // make sure it doesn't override shadow color
-			setUseShadow(false);
-
+			lsysRenderer.setViewer(camera.getEye());
+			lsysRenderer.display(queue, culler);
+			if(rasterizer != NULL) {
+				queue.drain(drawItems);
+				rasterizer->draw(drawItems);
+			} else {
+				queue.submit();
+				glDisable(GL_DEPTH_TEST); 
+			}
+		}
 
-			glDisable(GL_DEPTH_TEST); 
+		void display() {
+			render();
 
 			// output to hardware, double buffered
 			glFlush();
@@ -303,26 +511,95 @@ class Scene {
 		void reshape(int screenWidth, int screenHeight) {
 			this->screenWidth = screenWidth;
 			this->screenHeight = screenHeight;
-			glViewport(0, 0, screenWidth, screenHeight);
+			if(rasterizer != NULL) {
+				rasterizer->resize(screenWidth, screenHeight);
+			} else {
+				glViewport(0, 0, screenWidth, screenHeight);
+			}
 			updatePerspective();
 		}
 
+		// start reading the files a scene needs, so they're under way before
+		// there's a GL context to make one with
+		static void startLoading() {
+			// biggest first, since it takes longest
+			assetLoader.loadMesh("meshes/big_porsche.ply");
+			assetLoader.loadMesh("meshes/cow.ply");
+			assetLoader.loadBitmap("textures/grass.bmp");
+			assetLoader.loadBitmap("textures/stones.bmp");
+		}
+
+		// add and upload the meshes that have been read since last time,
+		// or wait for all of them if wait is set
+		// ones that couldn't be read are reported and left out
+		// returns true if any were added
+		bool updateAssets(bool wait = false) {
+			bool added = false;
+			for(size_t i = 0; i < loading.size(); i++) {
+				if(!wait && !AssetLoader::isReady(loading[i].second)) {
+					continue;
+				}
+				Mesh* mesh;
+				try {
+					mesh = loading[i].second.get();
+				} catch(const runtime_error& e) {
+					// drawn without it
+					cerr << e.what() << endl;
+					loading.erase(loading.begin() + i);
+					i--;
+					continue;
+				}
+				// big meshes are quantized to 16 bits within their bounding box
+				mesh->setLayout(VertexLayout(formatOverridden ? positionFormat
+							: VertexLayout::POSITION_SHORT3));
+				*loading[i].first = mesh;
+				meshes.push_back(mesh);
+				if(buffered) {
+					uploadMesh(mesh);
+				}
+				loading.erase(loading.begin() + i);
+				i--;
+				added = true;
+			}
+			return added;
+		}
+
+		// true while meshes are still being read
+		bool assetsPending() {
+			return !loading.empty();
+		}
+
 		Camera& getCamera() {
 			return camera;
 		}
 
+		// NULL when drawing with GL
+		SoftwareRasterizer* getRasterizer() {
+			return rasterizer;
+		}
+
 		void toggleGrass() {
 			showGrass = !showGrass;
-			glBindTexture(GL_TEXTURE_2D, showGrass ? textures[0] : textures[1]);
+			if(rasterizer == NULL) {
+				glBindTexture(GL_TEXTURE_2D, showGrass ? textures[0] : textures[1]);
+			}
 		}
 
 		void toggleShadows() {
 			showShadows = !showShadows;
 		}
 
+		void toggleQueueSorting() {
+			queue.toggleSorting();
+		}
+
+		void toggleCulling() {
+			culler.toggle();
+		}
+
 		void toggleExponentialFog() {
 			useExponentialFog = !useExponentialFog;
-			glUniform1i(glGetUniformLocationARB(program, "useExponentialFog"), useExponentialFog);
+			program->setUniform(program->uniform("useExponentialFog"), useExponentialFog);
 		}
 };
 
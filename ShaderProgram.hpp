@@ -0,0 +1,210 @@
+#ifndef __SHADERPROGRAM_H_
+#define __SHADERPROGRAM_H_
+
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+
+#include "Angel.h"
+#include "RenderStats.hpp"
+
+using std::string;
+using std::map;
+using std::vector;
+
+// a shader program built with InitShader whose uniform and attribute
+// locations are all looked up once when it's created
+// uniform values are shadowed on the CPU, so uploads that wouldn't change
+// anything are skipped and values can be read back without asking the driver
+// a software program has no GL behind it at all: its uniforms and
+// attributes come from the declarations in the shader source, and values
+// are only shadowed, for the software rasterizer to read
+class ShaderProgram {
+	private:
+		GLuint id;
+		bool software;
+		map<string, GLint> uniforms;
+		map<string, GLint> attributes;
+
+		// last value uploaded to each uniform location
+		struct UniformValue {
+			bool set;
+			GLfloat data[16];
+		};
+		vector<UniformValue> values;
+
+		// strip the [0] that arrays are reported with
+		static string baseName(const GLchar* name) {
+			string base(name);
+			size_t bracket = base.find('[');
+			return bracket == string::npos ? base : base.substr(0, bracket);
+		}
+
+		// remember data as loc's value, returns false if it's the value
+		// the program already has, so the upload can be skipped
+		bool changed(GLint loc, const void* data, size_t bytes) {
+			if(loc < 0 || (size_t)loc >= values.size()) {
+				return false; // not an active uniform, nothing to upload
+			}
+			UniformValue& value = values[loc];
+			if(value.set && memcmp(value.data, data, bytes) == 0) {
+				renderStats.uniformsSkipped++;
+				return false;
+			}
+			memcpy(value.data, data, bytes);
+			value.set = true;
+			renderStats.uniformUploads++;
+			return true;
+		}
+
+		// give every "uniform type name;" in a shader a location, and every
+		// "in type name;" too if withAttributes is set
+		void declare(const char* shaderFile, bool withAttributes) {
+			std::ifstream in(shaderFile);
+			if(!in) {
+				throw std::runtime_error(string("can't read shader: ") + shaderFile);
+			}
+			string line;
+			while(std::getline(in, line)) {
+				std::istringstream words(line);
+				string qualifier, type, name;
+				if(!(words >> qualifier >> type >> name)) {
+					continue;
+				}
+				name = name.substr(0, name.find_first_of(";["));
+				if(qualifier == "uniform" && uniforms.find(name) == uniforms.end()) {
+					GLint loc = uniforms.size();
+					uniforms[name] = loc;
+				} else if(withAttributes && qualifier == "in"
+						&& attributes.find(name) == attributes.end()) {
+					GLint loc = attributes.size();
+					attributes[name] = loc;
+				}
+			}
+		}
+
+	public:
+		// without software, this needs a current GL context
+		ShaderProgram(const char* vShaderFile, const char* fShaderFile, bool software = false) {
+			this->software = software;
+			if(software) {
+				id = 0;
+				declare(vShaderFile, true);
+				declare(fShaderFile, false);
+				UniformValue unset = {false, {0}};
+				values.assign(uniforms.size(), unset);
+				return;
+			}
+			id = InitShader(vShaderFile, fShaderFile);
+
+			GLint count, maxLength;
+			glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+			glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+			vector<GLchar> name(maxLength + 1);
+			GLint maxLoc = -1;
+			for(GLint i = 0; i < count; i++) {
+				GLint size;
+				GLenum type;
+				glGetActiveUniform(id, i, name.size(), NULL, &size, &type, &name[0]);
+				GLint loc = glGetUniformLocation(id, &name[0]);
+				uniforms[baseName(&name[0])] = loc;
+				maxLoc = std::max(maxLoc, loc);
+			}
+			UniformValue unset = {false, {0}};
+			values.assign(maxLoc + 1, unset);
+
+			glGetProgramiv(id, GL_ACTIVE_ATTRIBUTES, &count);
+			glGetProgramiv(id, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+			name.resize(maxLength + 1);
+			for(GLint i = 0; i < count; i++) {
+				GLint size;
+				GLenum type;
+				glGetActiveAttrib(id, i, name.size(), NULL, &size, &type, &name[0]);
+				attributes[baseName(&name[0])] = glGetAttribLocation(id, &name[0]);
+			}
+		}
+
+		GLuint getId() {
+			return id;
+		}
+
+		bool isSoftware() {
+			return software;
+		}
+
+		// location of the named uniform, -1 if the program doesn't use it
+		GLint uniform(const string& name) {
+			map<string, GLint>::iterator it = uniforms.find(name);
+			return it == uniforms.end() ? -1 : it->second;
+		}
+
+		// location of the named attribute, -1 if the program doesn't use it
+		GLint attribute(const string& name) {
+			map<string, GLint>::iterator it = attributes.find(name);
+			return it == attributes.end() ? -1 : it->second;
+		}
+
+		// matrices are row major, uploaded transposed like everywhere else
+		void setUniform(GLint loc, const mat4& matrix) {
+			if(changed(loc, (const GLfloat*)matrix, sizeof(mat4)) && !software) {
+				glUniformMatrix4fv(loc, 1, GL_TRUE, matrix);
+			}
+		}
+
+		void setUniform(GLint loc, const vec4& vector) {
+			if(changed(loc, (const GLfloat*)vector, sizeof(vec4)) && !software) {
+				glUniform4fv(loc, 1, vector);
+			}
+		}
+
+		void setUniform(GLint loc, GLfloat value) {
+			if(changed(loc, &value, sizeof(value)) && !software) {
+				glUniform1f(loc, value);
+			}
+		}
+
+		// also used for bools and samplers
+		void setUniform(GLint loc, GLint value) {
+			if(changed(loc, &value, sizeof(value)) && !software) {
+				glUniform1i(loc, value);
+			}
+		}
+
+		void setUniform(GLint loc, bool value) {
+			setUniform(loc, (GLint)value);
+		}
+
+		// last vec4 given to loc, without a round trip to the driver
+		vec4 getUniformVec4(GLint loc) {
+			if(loc < 0 || (size_t)loc >= values.size()) {
+				return vec4();
+			}
+			GLfloat* data = values[loc].data;
+			return vec4(data[0], data[1], data[2], data[3]);
+		}
+
+		// same for matrices
+		mat4 getUniformMat4(GLint loc) {
+			mat4 matrix;
+			if(loc >= 0 && (size_t)loc < values.size() && values[loc].set) {
+				memcpy((GLfloat*)matrix, values[loc].data, sizeof(mat4));
+			}
+			return matrix;
+		}
+
+		// and ints and bools
+		GLint getUniformInt(GLint loc) {
+			GLint value = 0;
+			if(loc >= 0 && (size_t)loc < values.size()) {
+				memcpy(&value, values[loc].data, sizeof(value));
+			}
+			return value;
+		}
+};
+
+#endif
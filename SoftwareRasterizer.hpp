@@ -0,0 +1,500 @@
+#ifndef __SOFTWARERASTERIZER_H_
+#define __SOFTWARERASTERIZER_H_
+
+#include <vector>
+#include <map>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include "Angel.h"
+#include "Mesh.hpp"
+#include "ShaderProgram.hpp"
+#include "RenderQueue.hpp"
+#include "RenderStats.hpp"
+#include "Parallel.hpp"
+
+using std::vector;
+using std::map;
+using std::string;
+using std::runtime_error;
+
+// draws render queue items on the CPU the way vshader1 and fshader1 do,
+// for machines without any GL
+// triangles are transformed and set up in parallel a batch at a time, put
+// into screen tiles in the order they were drawn, then the tiles are
+// filled in parallel, so every pixel still sees its triangles in order
+// only whole meshes are drawn, so the static tree batch and instanced
+// items are skipped
+class SoftwareRasterizer {
+	public:
+		// RGB, bottom row first like GL
+		struct Image {
+			int width, height;
+			vector<unsigned char> rgb;
+		};
+
+	private:
+		struct Vertex {
+			vec4 clip;
+			float s, t; // texture coordinates
+		};
+
+		// a triangle in window coordinates, counter clockwise, ready to fill
+		struct Triangle {
+			double x[3], y[3];
+			float z[3]; // window depth
+			float invW[3]; // 1 / clip w, for perspective correct texturing
+			float s[3], t[3]; // texture coordinates over w
+			double area;
+			int minX, minY, maxX, maxY; // pixels it could cover
+			vec4 color;
+			const Image* texture; // NULL to use color
+			bool shadow;
+		};
+
+		// one instance of one item
+		struct Job {
+			const DrawItem* item;
+			GLsizei instance;
+		};
+
+		ShaderProgram* program;
+		GLint projLoc;
+		GLint shadowLoc;
+		GLint shadowCopiesLoc;
+		GLint fogLoc;
+		// uniforms for the frame being drawn
+		mat4 projection;
+		mat4 shadowMatrix;
+		bool shadowCopies;
+		bool exponentialFog;
+
+		Image frame;
+		vector<float> depth;
+		map<GLuint, Image> textures;
+		WorkerPool pool;
+
+		static const int tileSize = 32;
+		static const size_t batchTriangles = 1 << 18; // set up before filling any
+		int tilesX, tilesY;
+		vector<vector<const Triangle*> > bins; // each tile's triangles, in draw order
+		vector<Job> jobs; // waiting to be set up
+		size_t pendingTriangles;
+		vector<vector<Triangle> > jobTriangles; // set up triangles of each job
+
+		// distance inside one of the six clip planes, negative if outside
+		static float planeDistance(const vec4& clip, int plane) {
+			float coord = clip[plane / 2];
+			return plane % 2 == 0 ? clip.w + coord : clip.w - coord;
+		}
+
+		static unsigned outcode(const vec4& clip) {
+			unsigned code = 0;
+			for(int plane = 0; plane < 6; plane++) {
+				if(planeDistance(clip, plane) < 0) {
+					code |= 1 << plane;
+				}
+			}
+			return code;
+		}
+
+		static Vertex lerp(const Vertex& a, const Vertex& b, float t) {
+			Vertex v;
+			v.clip = a.clip + (b.clip - a.clip) * t;
+			v.s = a.s + (b.s - a.s) * t;
+			v.t = a.t + (b.t - a.t) * t;
+			return v;
+		}
+
+		// clip a triangle to the view volume and set up what's left
+		void clipTriangle(const Vertex& a, const Vertex& b, const Vertex& c,
+				const Triangle& style, vector<Triangle>& out) {
+			unsigned codes[3] = {outcode(a.clip), outcode(b.clip), outcode(c.clip)};
+			if(codes[0] & codes[1] & codes[2]) {
+				return; // all outside the same plane
+			}
+			if((codes[0] | codes[1] | codes[2]) == 0) {
+				setUpTriangle(a, b, c, style, out);
+				return;
+			}
+			vector<Vertex> polygon;
+			polygon.push_back(a);
+			polygon.push_back(b);
+			polygon.push_back(c);
+			vector<Vertex> clipped;
+			for(int plane = 0; plane < 6 && !polygon.empty(); plane++) {
+				if(!((codes[0] | codes[1] | codes[2]) & (1 << plane))) {
+					continue;
+				}
+				clipped.clear();
+				for(size_t i = 0; i < polygon.size(); i++) {
+					const Vertex& from = polygon[i];
+					const Vertex& to = polygon[(i + 1) % polygon.size()];
+					float fromDistance = planeDistance(from.clip, plane);
+					float toDistance = planeDistance(to.clip, plane);
+					if(fromDistance >= 0) {
+						clipped.push_back(from);
+					}
+					if((fromDistance >= 0) != (toDistance >= 0)) {
+						clipped.push_back(lerp(from, to, fromDistance / (fromDistance - toDistance)));
+					}
+				}
+				polygon.swap(clipped);
+			}
+			for(size_t i = 2; i < polygon.size(); i++) {
+				setUpTriangle(polygon[0], polygon[i - 1], polygon[i], style, out);
+			}
+		}
+
+		// project a clipped triangle to the window, dropping it if it
+		// covers no pixel centers
+		void setUpTriangle(const Vertex& a, const Vertex& b, const Vertex& c,
+				const Triangle& style, vector<Triangle>& out) {
+			Triangle tri = style;
+			const Vertex* vertices[3] = {&a, &b, &c};
+			for(int i = 0; i < 3; i++) {
+				const vec4& clip = vertices[i]->clip;
+				float invW = 1 / clip.w;
+				tri.x[i] = (clip.x * invW + 1) * 0.5 * frame.width;
+				tri.y[i] = (clip.y * invW + 1) * 0.5 * frame.height;
+				tri.z[i] = (clip.z * invW + 1) * 0.5;
+				tri.invW[i] = invW;
+				tri.s[i] = vertices[i]->s * invW;
+				tri.t[i] = vertices[i]->t * invW;
+			}
+			tri.area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0])
+				- (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+			if(tri.area == 0) {
+				return;
+			}
+			if(tri.area < 0) {
+				std::swap(tri.x[1], tri.x[2]);
+				std::swap(tri.y[1], tri.y[2]);
+				std::swap(tri.z[1], tri.z[2]);
+				std::swap(tri.invW[1], tri.invW[2]);
+				std::swap(tri.s[1], tri.s[2]);
+				std::swap(tri.t[1], tri.t[2]);
+				tri.area = -tri.area;
+			}
+			// pixel centers are at .5
+			double minX = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+			double maxX = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+			double minY = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+			double maxY = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+			tri.minX = std::max(0, (int)ceil(minX - 0.5));
+			tri.maxX = std::min(frame.width - 1, (int)floor(maxX - 0.5));
+			tri.minY = std::max(0, (int)ceil(minY - 0.5));
+			tri.maxY = std::min(frame.height - 1, (int)floor(maxY - 0.5));
+			if(tri.minX > tri.maxX || tri.minY > tri.maxY) {
+				return;
+			}
+			out.push_back(tri);
+		}
+
+		// vertex shader for one instance of an item, then clipping and setup
+		void setUpJob(const Job& job, vector<Triangle>& out) {
+			out.clear();
+			const DrawItem& item = *job.item;
+			Mesh* mesh = item.mesh;
+			bool shadow = shadowCopies && job.instance % 2 == 1;
+			mat4 transform = projection * (shadow ? shadowMatrix * item.model : item.model);
+
+			Triangle style;
+			style.shadow = shadow;
+			style.color = item.color;
+			style.texture = NULL;
+			if(item.texture != 0) {
+				map<GLuint, Image>::const_iterator found = textures.find(item.texture);
+				if(found != textures.end()) {
+					style.texture = &found->second;
+				}
+			}
+
+			// positions are taken unpacked, so there's nothing to decode
+			static thread_local vector<Vertex> vertices;
+			const vec4* points = mesh->getBufferPoints();
+			vertices.resize(mesh->getNumBufferPoints());
+			for(size_t i = 0; i < vertices.size(); i++) {
+				vertices[i].clip = transform * points[i];
+				vertices[i].s = points[i].x;
+				vertices[i].t = points[i].z;
+			}
+			if(mesh->isIndexed()) {
+				const vector<GLuint>& indices = mesh->getIndices();
+				for(size_t i = 0; i + 2 < indices.size(); i += 3) {
+					clipTriangle(vertices[indices[i]], vertices[indices[i + 1]],
+							vertices[indices[i + 2]], style, out);
+				}
+			} else {
+				for(size_t i = 0; i + 2 < vertices.size(); i += 3) {
+					clipTriangle(vertices[i], vertices[i + 1], vertices[i + 2], style, out);
+				}
+			}
+		}
+
+		// texture2D with linear filtering and repeat wrapping
+		static vec4 sample(const Image& image, float s, float t) {
+			float u = s * image.width - 0.5;
+			float v = t * image.height - 0.5;
+			int u0 = (int)floor(u);
+			int v0 = (int)floor(v);
+			float fu = u - u0;
+			float fv = v - v0;
+			vec4 color(0, 0, 0, 1);
+			for(int corner = 0; corner < 4; corner++) {
+				int x = (u0 + (corner & 1)) % image.width;
+				int y = (v0 + (corner >> 1)) % image.height;
+				x += x < 0 ? image.width : 0;
+				y += y < 0 ? image.height : 0;
+				float weight = (corner & 1 ? fu : 1 - fu) * (corner >> 1 ? fv : 1 - fv);
+				const unsigned char* texel = &image.rgb[(y * image.width + x) * 3];
+				for(int i = 0; i < 3; i++) {
+					color[i] += weight * texel[i] / 255;
+				}
+			}
+			return color;
+		}
+
+		// fragment shader for every pixel of a triangle inside a tile
+		void fill(const Triangle& tri, int x0, int y0, int x1, int y1) {
+			x0 = std::max(x0, tri.minX);
+			y0 = std::max(y0, tri.minY);
+			x1 = std::min(x1, tri.maxX);
+			y1 = std::min(y1, tri.maxY);
+			// edge i runs from vertex i to the next, and is 0 at the third
+			double dx[3], dy[3];
+			bool topLeft[3];
+			for(int i = 0; i < 3; i++) {
+				int next = (i + 1) % 3;
+				dx[i] = tri.x[next] - tri.x[i];
+				dy[i] = tri.y[next] - tri.y[i];
+				// counter clockwise with y up, so left edges go down
+				topLeft[i] = dy[i] < 0 || (dy[i] == 0 && dx[i] < 0);
+			}
+			for(int py = y0; py <= y1; py++) {
+				double y = py + 0.5;
+				for(int px = x0; px <= x1; px++) {
+					double x = px + 0.5;
+					double edges[3];
+					bool inside = true;
+					for(int i = 0; i < 3 && inside; i++) {
+						edges[i] = dx[i] * (y - tri.y[i]) - dy[i] * (x - tri.x[i]);
+						inside = edges[i] > 0 || (edges[i] == 0 && topLeft[i]);
+					}
+					if(!inside) {
+						continue;
+					}
+					// edge i is opposite vertex i + 2
+					float weights[3] = {
+						(float)(edges[1] / tri.area),
+						(float)(edges[2] / tri.area),
+						(float)(edges[0] / tri.area)
+					};
+					float z = weights[0] * tri.z[0] + weights[1] * tri.z[1] + weights[2] * tri.z[2];
+					size_t pixel = (size_t)py * frame.width + px;
+					if(!(z < depth[pixel])) {
+						continue;
+					}
+					depth[pixel] = z;
+
+					float invW = weights[0] * tri.invW[0] + weights[1] * tri.invW[1]
+						+ weights[2] * tri.invW[2];
+					vec4 color;
+					if(tri.shadow) {
+						color = vec4(0, 0, 0, 1);
+					} else if(tri.texture != NULL) {
+						float s = weights[0] * tri.s[0] + weights[1] * tri.s[1] + weights[2] * tri.s[2];
+						float t = weights[0] * tri.t[0] + weights[1] * tri.t[1] + weights[2] * tri.t[2];
+						color = sample(*tri.texture, s / invW, t / invW);
+					} else {
+						color = tri.color;
+					}
+
+					float dist = fabs(z / invW);
+					float fogFactor = exponentialFog ? exp(-0.05 * dist) : (100 - dist) / 100;
+					fogFactor = std::max(0.0f, std::min(1.0f, fogFactor));
+					unsigned char* out = &frame.rgb[pixel * 3];
+					for(int i = 0; i < 3; i++) {
+						float value = std::max(0.0f, std::min(1.0f, color[i] * fogFactor));
+						out[i] = (unsigned char)(value * 255 + 0.5);
+					}
+				}
+			}
+		}
+
+		void fillTile(size_t tile) {
+			int x0 = (tile % tilesX) * tileSize;
+			int y0 = (tile / tilesX) * tileSize;
+			int x1 = std::min(x0 + tileSize, frame.width) - 1;
+			int y1 = std::min(y0 + tileSize, frame.height) - 1;
+			const vector<const Triangle*>& bin = bins[tile];
+			for(vector<const Triangle*>::const_iterator i = bin.begin(); i != bin.end(); ++i) {
+				fill(**i, x0, y0, x1, y1);
+			}
+		}
+
+		// set up every waiting job, then fill the tiles they touch
+		void flush() {
+			if(jobs.empty()) {
+				return;
+			}
+			if(jobTriangles.size() < jobs.size()) {
+				jobTriangles.resize(jobs.size());
+			}
+			pool.run(jobs.size(), [&](size_t job) {
+				setUpJob(jobs[job], jobTriangles[job]);
+			});
+			for(size_t job = 0; job < jobs.size(); job++) {
+				const vector<Triangle>& triangles = jobTriangles[job];
+				for(vector<Triangle>::const_iterator tri = triangles.begin(); tri != triangles.end(); ++tri) {
+					for(int ty = tri->minY / tileSize; ty <= tri->maxY / tileSize; ty++) {
+						for(int tx = tri->minX / tileSize; tx <= tri->maxX / tileSize; tx++) {
+							bins[ty * tilesX + tx].push_back(&*tri);
+						}
+					}
+				}
+			}
+			pool.run(bins.size(), [&](size_t tile) {
+				fillTile(tile);
+			});
+			for(size_t tile = 0; tile < bins.size(); tile++) {
+				bins[tile].clear();
+			}
+			jobs.clear();
+			pendingTriangles = 0;
+		}
+
+		static void writeLittleEndian(std::ofstream& out, unsigned value, int bytes) {
+			for(int i = 0; i < bytes; i++) {
+				out.put((char)((value >> (i * 8)) & 0xff));
+			}
+		}
+
+	public:
+		SoftwareRasterizer(ShaderProgram* program) {
+			this->program = program;
+			projLoc = program->uniform("projection_matrix");
+			shadowLoc = program->uniform("shadow_matrix");
+			shadowCopiesLoc = program->uniform("shadowCopies");
+			fogLoc = program->uniform("useExponentialFog");
+			pendingTriangles = 0;
+			resize(1, 1);
+		}
+
+		void resize(int width, int height) {
+			frame.width = std::max(width, 1);
+			frame.height = std::max(height, 1);
+			frame.rgb.assign((size_t)frame.width * frame.height * 3, 0);
+			depth.assign((size_t)frame.width * frame.height, 1);
+			tilesX = (frame.width + tileSize - 1) / tileSize;
+			tilesY = (frame.height + tileSize - 1) / tileSize;
+			bins.assign(tilesX * tilesY, vector<const Triangle*>());
+		}
+
+		// what glTexImage2D would get for texture name: RGB rows from the
+		// bottom up, each padded to 4 bytes like GL's default unpack alignment
+		void setTexture(GLuint name, int width, int height, const unsigned char* rgb) {
+			Image& image = textures[name];
+			image.width = width;
+			image.height = height;
+			image.rgb.resize((size_t)width * height * 3);
+			size_t stride = ((size_t)width * 3 + 3) & ~(size_t)3;
+			for(int row = 0; row < height; row++) {
+				std::copy(rgb + row * stride, rgb + row * stride + width * 3,
+						image.rgb.begin() + (size_t)row * width * 3);
+			}
+		}
+
+		// to black, and the farthest depth
+		void clear() {
+			std::fill(frame.rgb.begin(), frame.rgb.end(), 0);
+			std::fill(depth.begin(), depth.end(), 1.0f);
+		}
+
+		// draw items in order, with the uniforms the program has now
+		void draw(const vector<DrawItem>& items) {
+			projection = program->getUniformMat4(projLoc);
+			shadowMatrix = program->getUniformMat4(shadowLoc);
+			shadowCopies = program->getUniformInt(shadowCopiesLoc) != 0;
+			exponentialFog = program->getUniformInt(fogLoc) != 0;
+			for(vector<DrawItem>::const_iterator item = items.begin(); item != items.end(); ++item) {
+				if(item->mesh == NULL || item->instanceBuffer != 0) {
+					continue;
+				}
+				for(GLsizei instance = 0; instance < item->instances; instance++) {
+					Job job = {&*item, instance};
+					jobs.push_back(job);
+					pendingTriangles += item->count / 3;
+					if(pendingTriangles >= batchTriangles) {
+						flush();
+					}
+				}
+				renderStats.countDraw(item->count, item->instances);
+			}
+			flush();
+		}
+
+		const Image& getFrame() {
+			return frame;
+		}
+
+		unsigned getThreadCount() {
+			return pool.size();
+		}
+
+		// save the frame as a .bmp, or a .ppm for any other extension
+		void writeImage(const string& path) {
+			std::ofstream out(path.c_str(), std::ios::binary);
+			if(!out) {
+				throw runtime_error("can't write image: " + path);
+			}
+			int width = frame.width;
+			int height = frame.height;
+			bool bmp = path.size() >= 4 && path.compare(path.size() - 4, 4, ".bmp") == 0;
+			if(bmp) {
+				// 24 bit, bottom row first, rows padded to 4 bytes
+				unsigned stride = (width * 3 + 3) & ~3;
+				unsigned imageBytes = stride * height;
+				out.put('B');
+				out.put('M');
+				writeLittleEndian(out, 54 + imageBytes, 4);
+				writeLittleEndian(out, 0, 4);
+				writeLittleEndian(out, 54, 4);
+				writeLittleEndian(out, 40, 4);
+				writeLittleEndian(out, width, 4);
+				writeLittleEndian(out, height, 4);
+				writeLittleEndian(out, 1, 2);
+				writeLittleEndian(out, 24, 2);
+				writeLittleEndian(out, 0, 4);
+				writeLittleEndian(out, imageBytes, 4);
+				for(int i = 0; i < 4; i++) {
+					writeLittleEndian(out, 0, 4);
+				}
+				for(int row = 0; row < height; row++) {
+					const unsigned char* pixel = &frame.rgb[(size_t)row * width * 3];
+					for(int x = 0; x < width; x++, pixel += 3) {
+						out.put(pixel[2]);
+						out.put(pixel[1]);
+						out.put(pixel[0]);
+					}
+					for(unsigned pad = width * 3; pad < stride; pad++) {
+						out.put(0);
+					}
+				}
+			} else {
+				// top row first
+				out << "P6\n" << width << " " << height << "\n255\n";
+				for(int row = height - 1; row >= 0; row--) {
+					out.write((const char*)&frame.rgb[(size_t)row * width * 3], width * 3);
+				}
+			}
+			if(!out) {
+				throw runtime_error("can't write image: " + path);
+			}
+		}
+};
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef __TREEBATCH_H_
+#define __TREEBATCH_H_
+
+#include <vector>
+#include <future>
+
+#include "Mesh.hpp"
+#include "Parallel.hpp"
+#include "RenderStats.hpp"
+#include "ShaderProgram.hpp"
+#include "RenderQueue.hpp"
+#include "BufferArena.hpp"
+
+using std::vector;
+
+// world space box around one [ ... ] branch of a baked tree
+// a branch's segments are contiguous since they're baked in string order
+struct BranchBounds {
+	size_t firstSegment, endSegment; // including nested branches
+	size_t end; // index of the next branch that isn't nested in this one
+	vec3 boundsMin, boundsMax;
+};
+
+// final model matrices for every component of a placed tree
+struct BakedTree {
+	vector<mat4> spheres;
+	vector<mat4> cylinders;
+	vector<unsigned char> depths; // bracket nesting depth of each segment
+	vec3 boundsMin, boundsMax; // world space box around every segment
+	vector<BranchBounds> branches; // big enough branches, parents before children
+	BufferRange* instances; // spheres then cylinders, for instanced drawing
+
+	BakedTree() {
+		instances = NULL;
+	}
+};
+
+// one vertex of a pre-transformed tree component
+struct BatchVertex {
+	GLfloat position[3];
+	GLubyte color[4];
+};
+
+// every placed tree's component geometry pre-transformed into one static
+// vertex buffer, so a whole forest is a single draw call
+// the transforming happens on a background thread, update() uploads the
+// result once it's done
+class TreeBatch {
+	private:
+		GLuint vao;
+		GLuint buffer;
+		GLsizei numVertices;
+		bool ready;
+		std::future<vector<BatchVertex>*> pending;
+		vector<std::future<vector<BatchVertex>*> > abandoned; // replaced while running
+
+		GLint posLoc;
+		GLint colorLoc;
+
+		// copies of the vertex data that are safe to read from the worker
+		vector<vec4> spherePoints;
+		vector<vec4> cylinderPoints;
+
+		// transform one kind of component into out for every model matrix
+		static void transformComponents(const vector<mat4>& models, const vector<vec4>& points,
+				vec4 color, BatchVertex* out) {
+			GLubyte packed[4];
+			for(int i = 0; i < 4; i++) {
+				packed[i] = (GLubyte)(color[i] * 255 + 0.5);
+			}
+			parallelChunks(models.size(), workerCount(), [&](unsigned, size_t begin, size_t end) {
+				BatchVertex* vertex = out + begin * points.size();
+				for(size_t m = begin; m < end; m++) {
+					const mat4& model = models[m];
+					for(vector<vec4>::const_iterator p = points.begin(); p != points.end(); ++p) {
+						vec4 position = model * (*p);
+						vertex->position[0] = position.x;
+						vertex->position[1] = position.y;
+						vertex->position[2] = position.z;
+						for(int i = 0; i < 4; i++) {
+							vertex->color[i] = packed[i];
+						}
+						vertex++;
+					}
+				}
+			});
+		}
+
+		// all a build needs of one tree, copied so the worker shares nothing
+		// with the GL thread, which may bake the trees again meanwhile
+		struct TreeComponents {
+			vector<mat4> spheres;
+			vector<mat4> cylinders;
+			vec4 color;
+		};
+
+		static vector<BatchVertex>* build(vector<TreeComponents> trees,
+				const vector<vec4>* spherePoints, const vector<vec4>* cylinderPoints) {
+			size_t total = 0;
+			for(vector<TreeComponents>::const_iterator i = trees.begin(); i != trees.end(); ++i) {
+				total += i->spheres.size() * spherePoints->size()
+					+ i->cylinders.size() * cylinderPoints->size();
+			}
+			vector<BatchVertex>* vertices = new vector<BatchVertex>(total);
+			if(total == 0) {
+				return vertices;
+			}
+			BatchVertex* out = &(*vertices)[0];
+			for(vector<TreeComponents>::const_iterator i = trees.begin(); i != trees.end(); ++i) {
+				transformComponents(i->spheres, *spherePoints, i->color, out);
+				out += i->spheres.size() * spherePoints->size();
+				transformComponents(i->cylinders, *cylinderPoints, i->color, out);
+				out += i->cylinders.size() * cylinderPoints->size();
+			}
+			return vertices;
+		}
+
+	public:
+		TreeBatch(ShaderProgram* program, Mesh* sphere, Mesh* cylinder) {
+			posLoc = program->attribute("vPosition");
+			colorLoc = program->attribute("vColor");
+			spherePoints.assign(sphere->getPoints(), sphere->getPoints() + sphere->getNumPoints());
+			cylinderPoints.assign(cylinder->getPoints(), cylinder->getPoints() + cylinder->getNumPoints());
+			numVertices = 0;
+			ready = false;
+
+			GLint oldVao, oldBuffer;
+			glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &oldVao);
+			glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &oldBuffer);
+			glGenVertexArrays(1, &vao);
+			glBindVertexArray(vao);
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			glEnableVertexAttribArray(posLoc);
+			glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE, sizeof(BatchVertex),
+					BUFFER_OFFSET(0));
+			glEnableVertexAttribArray(colorLoc);
+			glVertexAttribPointer(colorLoc, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BatchVertex),
+					BUFFER_OFFSET(sizeof(GLfloat) * 3));
+			glBindVertexArray(oldVao);
+			glBindBuffer(GL_ARRAY_BUFFER, oldBuffer);
+		}
+
+		// start transforming the given trees in the background
+		// the current batch is out of date, so it won't be drawn until then
+		void rebuild(const vector<BakedTree>& trees, const vector<vec4>& colors) {
+			ready = false;
+			if(pending.valid()) {
+				// don't wait for it here, update() cleans it up later
+				abandoned.push_back(std::move(pending));
+			}
+			// only the matrices are copied, and moved from there into the task
+			vector<TreeComponents> components(trees.size());
+			for(size_t i = 0; i < trees.size(); i++) {
+				components[i].spheres = trees[i].spheres;
+				components[i].cylinders = trees[i].cylinders;
+				components[i].color = colors[i];
+			}
+			pending = std::async(std::launch::async, build, std::move(components),
+					&spherePoints, &cylinderPoints);
+		}
+
+		// upload the rebuilt batch if the background work is done
+		// returns true if the batch changed
+		bool update() {
+			for(size_t i = 0; i < abandoned.size(); i++) {
+				if(abandoned[i].wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+					delete abandoned[i].get();
+					abandoned.erase(abandoned.begin() + i);
+					i--;
+				}
+			}
+			if(!pending.valid()
+					|| pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				return false;
+			}
+			vector<BatchVertex>* vertices = pending.get();
+			GLint oldBuffer;
+			glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &oldBuffer);
+			glBindBuffer(GL_ARRAY_BUFFER, buffer);
+			numVertices = vertices->size();
+			glBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(BatchVertex),
+					numVertices > 0 ? &(*vertices)[0] : NULL, GL_STATIC_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, oldBuffer);
+			delete vertices;
+			ready = true;
+			return true;
+		}
+
+		// true while a rebuild is running in the background
+		bool isPending() {
+			return pending.valid();
+		}
+
+		bool isReady() {
+			return ready;
+		}
+
+		// queue the whole batch in each tree's color, copies times over
+		// (the second copy is the shadow)
+		void draw(RenderQueue& queue, GLsizei copies) {
+			DrawItem item(0, numVertices, copies);
+			item.vao = vao;
+			item.useVertexColor = true; // model stays identity, already in world space
+			queue.add(item);
+		}
+};
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef __TURTLEROPE_H_
+#define __TURTLEROPE_H_
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// shared-subtree (DAG) representation of a derived turtle string
+// every occurrence of a symbol at a given depth expands to the same
+// substring, so each (symbol, depth) pair becomes one node that all of its
+// occurrences refer to, instead of copying the expansion everywhere
+class TurtleRope {
+	private:
+		static const unsigned noNode = ~0u;
+
+		// a node's expansion is a sequence of pieces, each either a run of
+		// final symbols stored in literals or a reference to a child node
+		struct Piece {
+			unsigned node; // noNode for a literal run
+			unsigned literalStart;
+			unsigned literalLength;
+		};
+
+		struct Node {
+			unsigned firstPiece;
+			unsigned numPieces;
+			unsigned long long length; // symbols in the full expansion
+		};
+
+		vector<Node> nodes;
+		vector<Piece> pieces;
+		string literals;
+		vector<unsigned> memo; // node for (depth * 256 + symbol), or noNode
+		unsigned root;
+
+		const vector<string>* rules;
+		const vector<string>* reps;
+		const vector<bool>* expands;
+
+		void flushRun(string& run, vector<Piece>& nodePieces) {
+			if(run.empty()) {
+				return;
+			}
+			Piece piece = {noNode, (unsigned)literals.size(), (unsigned)run.size()};
+			nodePieces.push_back(piece);
+			literals += run;
+			run.clear();
+		}
+
+		// node for rhs with depth iterations left to apply to its symbols
+		unsigned buildNode(const string& rhs, unsigned depth) {
+			vector<Piece> nodePieces; // children get built in between pieces
+			string run;
+			unsigned long long length = 0;
+			for(string::const_iterator it = rhs.begin(); it != rhs.end(); ++it) {
+				unsigned char current = *it;
+				if(depth > 0 && (*expands)[current]) {
+					unsigned child = symbolNode(current, depth - 1);
+					if(nodes[child].length == 0) {
+						continue; // everything in it was removed by replacements
+					}
+					flushRun(run, nodePieces);
+					Piece piece = {child, 0, 0};
+					nodePieces.push_back(piece);
+					length += nodes[child].length;
+				} else {
+					run += (*reps)[current];
+					length += (*reps)[current].size();
+				}
+			}
+			flushRun(run, nodePieces);
+
+			Node node = {(unsigned)pieces.size(), (unsigned)nodePieces.size(), length};
+			pieces.insert(pieces.end(), nodePieces.begin(), nodePieces.end());
+			nodes.push_back(node);
+			return nodes.size() - 1;
+		}
+
+		// node for symbol's rule with depth iterations left, built only once
+		unsigned symbolNode(unsigned char symbol, unsigned depth) {
+			unsigned key = depth * 256 + symbol;
+			if(memo[key] == noNode) {
+				memo[key] = buildNode((*rules)[symbol], depth);
+			}
+			return memo[key];
+		}
+
+	public:
+		// walks the rope in order, yielding one symbol at a time
+		class Iterator {
+			private:
+				const TurtleRope* rope;
+				vector<std::pair<unsigned, unsigned> > frames; // node, next piece
+				const char* run;
+				const char* runEnd;
+
+				// move run to the next literal run, returns false at the end
+				bool advance() {
+					while(!frames.empty()) {
+						std::pair<unsigned, unsigned>& top = frames.back();
+						const Node& node = rope->nodes[top.first];
+						if(top.second == node.numPieces) {
+							frames.pop_back();
+							continue;
+						}
+						const Piece& piece = rope->pieces[node.firstPiece + top.second];
+						top.second++;
+						if(piece.node != noNode) {
+							frames.push_back(std::make_pair(piece.node, 0u));
+							continue;
+						}
+						run = rope->literals.data() + piece.literalStart;
+						runEnd = run + piece.literalLength;
+						return true;
+					}
+					return false;
+				}
+
+			public:
+				Iterator(const TurtleRope* rope) {
+					this->rope = rope;
+					run = runEnd = NULL;
+					if(!rope->nodes.empty()) {
+						frames.push_back(std::make_pair(rope->root, 0u));
+					}
+				}
+
+				// start offset symbols in, skipping whole pieces by their
+				// lengths on the way down rather than walking them
+				Iterator(const TurtleRope* rope, unsigned long long offset) {
+					this->rope = rope;
+					run = runEnd = NULL;
+					if(rope->nodes.empty() || offset >= rope->getLength()) {
+						return;
+					}
+					frames.push_back(std::make_pair(rope->root, 0u));
+					while(true) {
+						std::pair<unsigned, unsigned>& top = frames.back();
+						const Piece& piece = rope->pieces[rope->nodes[top.first].firstPiece + top.second];
+						top.second++;
+						unsigned long long length = piece.node == noNode ? piece.literalLength
+							: rope->nodes[piece.node].length;
+						if(offset >= length) {
+							offset -= length;
+						} else if(piece.node != noNode) {
+							frames.push_back(std::make_pair(piece.node, 0u));
+						} else {
+							run = rope->literals.data() + piece.literalStart + offset;
+							runEnd = rope->literals.data() + piece.literalStart + piece.literalLength;
+							return;
+						}
+					}
+				}
+
+				// put the next symbol in symbol, returns false when there are none left
+				bool next(char& symbol) {
+					while(run == runEnd) {
+						if(!advance()) {
+							return false;
+						}
+					}
+					symbol = *run++;
+					return true;
+				}
+		};
+
+		TurtleRope() {
+			root = noNode;
+			rules = reps = NULL;
+			expands = NULL;
+		}
+
+		// derive start for the given iterations using one-iteration rules,
+		// final replacements and whether each char's rule changes it
+		void build(const string& start, unsigned iterations, const vector<string>& rules,
+				const vector<string>& reps, const vector<bool>& expands) {
+			this->rules = &rules;
+			this->reps = &reps;
+			this->expands = &expands;
+			nodes.clear();
+			pieces.clear();
+			literals.clear();
+			memo.assign((iterations + 1) * 256, (unsigned)noNode);
+			root = buildNode(start, iterations);
+		}
+
+		Iterator begin() const {
+			return Iterator(this);
+		}
+
+		// iterator starting at the symbol offset symbols in
+		Iterator at(unsigned long long offset) const {
+			return Iterator(this, offset);
+		}
+
+		// length of the derived string this represents
+		unsigned long long getLength() const {
+			return nodes.empty() ? 0 : nodes[root].length;
+		}
+
+		unsigned getNumNodes() const {
+			return nodes.size();
+		}
+
+		// memory held by the rope itself
+		size_t getBytes() const {
+			return nodes.size() * sizeof(Node) + pieces.size() * sizeof(Piece)
+				+ literals.size() + memo.size() * sizeof(unsigned);
+		}
+};
+
+#endif
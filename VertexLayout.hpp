@@ -0,0 +1,171 @@
+#ifndef __VERTEXLAYOUT_H_
+#define __VERTEXLAYOUT_H_
+
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+#include "Angel.h"
+
+using std::string;
+
+// how a mesh's vertices are stored in a vertex buffer
+// positions are full vec4s, vec3s (w is always 1 anyway) or shorts
+// quantized to the mesh's bounds, normals are vec4s or packed into 32 bits
+// quantized positions need getDecodeMatrix applied before the model matrix
+class VertexLayout {
+	public:
+		enum PositionFormat { POSITION_FLOAT4, POSITION_FLOAT3, POSITION_SHORT3 };
+		enum NormalFormat { NORMAL_NONE, NORMAL_FLOAT4, NORMAL_PACKED };
+
+	private:
+		PositionFormat positionFormat;
+		NormalFormat normalFormat;
+		vec3 center; // short positions are offsets from here
+		vec3 step; // per unit of a short position
+
+		// -1..1 to a signed 10 bit field
+		static GLuint packComponent(float value) {
+			int packed = (int)floor(std::max(-1.0f, std::min(1.0f, value)) * 511 + 0.5);
+			return (GLuint)packed & 0x3ff;
+		}
+
+	public:
+		VertexLayout(PositionFormat positionFormat = POSITION_FLOAT4,
+				NormalFormat normalFormat = NORMAL_NONE) {
+			this->positionFormat = positionFormat;
+			this->normalFormat = normalFormat;
+			center = vec3(0, 0, 0);
+			step = vec3(1, 1, 1);
+		}
+
+		PositionFormat getPositionFormat() {
+			return positionFormat;
+		}
+
+		NormalFormat getNormalFormat() {
+			return normalFormat;
+		}
+
+		// short positions get a fourth, unused short to keep vertices 4 byte aligned
+		GLsizei getPositionSize() {
+			switch(positionFormat) {
+				case POSITION_FLOAT3:
+					return 3 * sizeof(GLfloat);
+				case POSITION_SHORT3:
+					return 4 * sizeof(GLshort);
+				default:
+					return sizeof(vec4);
+			}
+		}
+
+		// keeps the bounds, unlike making a new layout
+		void setNormalFormat(NormalFormat normalFormat) {
+			this->normalFormat = normalFormat;
+		}
+
+		GLsizei getNormalSize() {
+			switch(normalFormat) {
+				case NORMAL_FLOAT4:
+					return sizeof(vec4);
+				case NORMAL_PACKED:
+					return sizeof(GLuint);
+				default:
+					return 0;
+			}
+		}
+
+		// positions and normals are interleaved
+		GLsizei getStride() {
+			return getPositionSize() + getNormalSize();
+		}
+
+		// fit short positions to a box, needed before packing them
+		void setBounds(vec3 min, vec3 max) {
+			center = (min + max) / 2;
+			for(int axis = 0; axis < 3; axis++) {
+				float half = (max[axis] - min[axis]) / 2;
+				step[axis] = half > 0 ? half / 32767 : 1;
+			}
+		}
+
+		// takes stored positions back to the mesh's own space
+		mat4 getDecodeMatrix() {
+			if(positionFormat != POSITION_SHORT3) {
+				return mat4();
+			}
+			return Translate(center.x, center.y, center.z) * Scale(step.x, step.y, step.z);
+		}
+
+		// write count vertices to dest, normals can be NULL if there aren't any
+		void pack(const vec4* positions, const vec4* normals, unsigned count, void* dest) {
+			char* vertex = (char*)dest;
+			for(unsigned i = 0; i < count; i++) {
+				const vec4& position = positions[i];
+				if(positionFormat == POSITION_SHORT3) {
+					GLshort* shorts = (GLshort*)vertex;
+					for(int axis = 0; axis < 3; axis++) {
+						float steps = floor((position[axis] - center[axis]) / step[axis] + 0.5);
+						shorts[axis] = (GLshort)std::max(-32767.0f, std::min(32767.0f, steps));
+					}
+					shorts[3] = 0;
+				} else {
+					memcpy(vertex, (const GLfloat*)position, getPositionSize());
+				}
+				char* normal = vertex + getPositionSize();
+				vec4 n = normals != NULL ? normals[i] : vec4(0, 0, 0, 0);
+				if(normalFormat == NORMAL_FLOAT4) {
+					memcpy(normal, (const GLfloat*)n, sizeof(vec4));
+				} else if(normalFormat == NORMAL_PACKED) {
+					GLuint packed = packComponent(n.x) | packComponent(n.y) << 10
+						| packComponent(n.z) << 20;
+					memcpy(normal, &packed, sizeof(packed));
+				}
+				vertex += getStride();
+			}
+		}
+
+		// point the attributes at vertices packed offset bytes into the
+		// bound array buffer, normalLoc is ignored without normals
+		void setPointers(GLint positionLoc, GLint normalLoc, GLintptr offset) {
+			GLsizei stride = getStride();
+			if(positionLoc >= 0) {
+				glEnableVertexAttribArray(positionLoc);
+				if(positionFormat == POSITION_SHORT3) {
+					glVertexAttribPointer(positionLoc, 3, GL_SHORT, GL_FALSE, stride, BUFFER_OFFSET(offset));
+				} else {
+					glVertexAttribPointer(positionLoc, positionFormat == POSITION_FLOAT3 ? 3 : 4,
+							GL_FLOAT, GL_FALSE, stride, BUFFER_OFFSET(offset));
+				}
+			}
+			if(normalLoc >= 0 && normalFormat != NORMAL_NONE) {
+				GLintptr normalOffset = offset + getPositionSize();
+				glEnableVertexAttribArray(normalLoc);
+				if(normalFormat == NORMAL_PACKED) {
+					glVertexAttribPointer(normalLoc, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride,
+							BUFFER_OFFSET(normalOffset));
+				} else {
+					glVertexAttribPointer(normalLoc, 4, GL_FLOAT, GL_FALSE, stride,
+							BUFFER_OFFSET(normalOffset));
+				}
+			}
+		}
+
+		// position format from its name on the command line, returns false
+		// if there isn't one by that name
+		static bool parsePositionFormat(const string& name, PositionFormat& format) {
+			if(name == "float4") {
+				format = POSITION_FLOAT4;
+			} else if(name == "float3") {
+				format = POSITION_FLOAT3;
+			} else if(name == "short3") {
+				format = POSITION_SHORT3;
+			} else {
+				return false;
+			}
+			return true;
+		}
+};
+
+#endif
@@ -3,14 +3,21 @@
 uniform vec4 inColor;
 uniform sampler2D texture;
 uniform bool useTexture;
+uniform bool useVertexColor;
 uniform bool useExponentialFog;
 in vec2 texCoord;
+in vec4 vertexColor;
+flat in int isShadow;
 out vec4 fColor;
 
 
 void main() {
-	if(useTexture) {
+	if(isShadow == 1) {
+		fColor = vec4(0, 0, 0, 1);
+	} else if(useTexture) {
 		fColor = texture2D(texture, texCoord);
+	} else if(useVertexColor) {
+		fColor = vertexColor;
 	} else {
 		fColor = inColor;
 	}
@@ -6,27 +6,54 @@
 #endif
 #include <vector>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 #include <time.h>
+#include <thread>
+#include <chrono>
 
 #include "Angel.h"
+#include "ShaderProgram.hpp"
 #include "Mesh.hpp"
 #include "PLYReader.hpp"
+#include "MeshCache.hpp"
+#include "AssetLoader.hpp"
 #include "MeshRenderer.hpp"
 #include "LSystem.hpp"
 #include "LSystemReader.hpp"
 #include "LSystemRenderer.hpp"
 #include "Scene.hpp"
+#include "Benchmark.hpp"
 
 // remember to prototype
 void display(void);
 void keyboard(unsigned char key, int x, int y);
+void idle(void);
 
 LSystemRenderer* lsysRenderer;
 Scene* scene;
 
+// most memory an lsystem's turtle string, or its baked segments, may take
+// set with --lsystem-budget MB
+unsigned long long lsystemBudget = 256ULL << 20;
+// draw meshes from shared vertices, off with --unindexed
+bool indexMeshes = true;
+// merge vertices at the same position when indexing, off with --no-weld
+bool weldMeshes = true;
+// store every mesh's positions this way, with --vertex-format float4|float3|short3
+// (otherwise each mesh keeps its own)
+bool overridePositionFormat = false;
+VertexLayout::PositionFormat positionFormat;
+// render this many frames offscreen and print how long they took, with
+// --bench FRAMES, instead of opening a window
+unsigned benchFrames = 0;
+// draw with the CPU instead of GL and save the last frame here, with
+// --software IMAGE (.bmp or .ppm)
+string softwareImage;
+
 using namespace std;
 
-GLuint setUpShaders(void) {	
+ShaderProgram* setUpShaders(void) {	
 	// Create a vertex array object
 	GLuint vao;
 	glGenVertexArrays(1, &vao);
@@ -38,8 +65,8 @@ GLuint setUpShaders(void) {
 	glBindBuffer(GL_ARRAY_BUFFER, buffer);
 
 	// Load shaders and use the resulting shader program
-	GLuint program = InitShader("vshader1.glsl", "fshader1.glsl");
-	glUseProgram(program);
+	ShaderProgram* program = new ShaderProgram("vshader1.glsl", "fshader1.glsl");
+	glUseProgram(program->getId());
 
 	// sets the default color to clear screen
 	glClearColor(0,0,0, 1.0); // black background
@@ -106,10 +133,46 @@ void keyboard(unsigned char key, int x, int y) {
 		case 'R':
 			lsysRenderer->showAllSystemsRandomly();
 			break;
+		case 'I':
+			lsysRenderer->toggleInstancing();
+			break;
+		case 'B':
+			lsysRenderer->toggleBatching();
+			break;
+		case 'O':
+			lsysRenderer->toggleLods();
+			break;
+		case 'P':
+			renderStats.print();
+			break;
+		case 'Q':
+			scene->toggleQueueSorting();
+			break;
+		case 'C':
+			scene->toggleCulling();
+			break;
+	}
+	if(lsysRenderer->batchPending()) {
+		glutIdleFunc(idle); // redraw once the batch is done
 	}
 	glutPostRedisplay();
 }
 
+// only runs while the static tree batch is building in the background, or
+// meshes are still being read
+void idle(void) {
+	bool changed = lsysRenderer->updateBatch();
+	changed = scene->updateAssets() || changed;
+	if(changed) {
+		glutPostRedisplay();
+	}
+	if(!lsysRenderer->batchPending() && !scene->assetsPending()) {
+		glutIdleFunc(NULL);
+	} else {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5)); // leave the cores to the workers
+	}
+}
+
 vector<string>* getFileNames(const char* path) {
 	vector<string>* names = new vector<string>();
 	DIR* directory;
@@ -129,22 +192,160 @@ vector<string>* getFileNames(const char* path) {
 }
 
 
+// true if arg is one of the command line arguments, before glut has
+// had a chance to take any
+bool hasArgument(int argc, char** argv, string arg) {
+	for(int i = 1; i < argc; i++) {
+		if(arg == argv[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// handle any command line arguments glut didn't take
+void parseArguments(int argc, char** argv) {
+	for(int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if(arg == "--lsystem-budget" && i + 1 < argc) {
+			// whole megabytes, and few enough that they still fit in bytes
+			const char* value = argv[++i];
+			char* end;
+			errno = 0;
+			unsigned long long megabytes = strtoull(value, &end, 10);
+			if(end == value || *end != '\0' || *value == '-' || errno == ERANGE
+					|| megabytes == 0 || megabytes > (ULLONG_MAX >> 20)) {
+				cerr << "L-system budget must be a positive number of MB: " << value << endl;
+				exit(EXIT_FAILURE);
+			}
+			lsystemBudget = megabytes << 20;
+		} else if(arg == "--unindexed") {
+			indexMeshes = false;
+		} else if(arg == "--no-weld") {
+			weldMeshes = false;
+		} else if(arg == "--vertex-format" && i + 1 < argc) {
+			if(!VertexLayout::parsePositionFormat(argv[++i], positionFormat)) {
+				cerr << "Unknown vertex format: " << argv[i] << endl;
+				exit(EXIT_FAILURE);
+			}
+			overridePositionFormat = true;
+		} else if(arg == "--bench" && i + 1 < argc) {
+			const char* value = argv[++i];
+			char* end;
+			errno = 0;
+			unsigned long frames = strtoul(value, &end, 10);
+			if(end == value || *end != '\0' || *value == '-' || errno == ERANGE
+					|| frames == 0 || frames > UINT_MAX) {
+				cerr << "Need a positive number of frames to benchmark: " << value << endl;
+				exit(EXIT_FAILURE);
+			}
+			benchFrames = frames;
+		} else if(arg == "--software" && i + 1 < argc) {
+			softwareImage = argv[++i];
+		} else if(arg == "--no-mesh-cache") {
+			meshCache.setEnabled(false);
+		} else {
+			cerr << "Unknown argument: " << arg << endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+// wait for the lsystems being read, in order, and fit them in the budget
+void finishLSystems(vector<std::shared_future<LSystem*> >& loads, vector<LSystem*>& lsystems) {
+	for(vector<std::shared_future<LSystem*> >::iterator i = loads.begin(); i != loads.end(); ++i) {
+		LSystem* lsys = i->get();
+		lsys->setMemoryBudget(lsystemBudget);
+		lsys->setSegmentBytes(LSystemRenderer::bytesPerSegment);
+		if(lsys->clampIterations()) {
+			cout << lsys->getName() << " would not fit in memory, using "
+				<< lsys->iterations << " iterations" << endl;
+		}
+		lsystems.push_back(lsys);
+		//lsystems[lsystems.size() - 1]->print();
+	}
+}
+
+// set up the trees, meshes and scene with the current options
+// unless waitForAssets is set, big meshes are drawn once they're read
+void createScene(ShaderProgram* program, vector<LSystem*>& lsystems, bool waitForAssets) {
+	lsysRenderer = new LSystemRenderer(program, lsystems);
+	
+	scene = new Scene(program, *lsysRenderer);
+	if(overridePositionFormat) {
+		scene->setPositionFormat(positionFormat);
+	}
+	if(waitForAssets) {
+		scene->updateAssets(true);
+	}
+	scene->bufferPoints(indexMeshes, weldMeshes);
+}
+
+
 //----------------------------------------------------------------------------
 // entry point
 int main(int argc, char **argv) {
-	// init glut
-	glutInit(&argc, argv);
-	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
-	glutInitWindowSize(512, 512);
+	// init glut, unless there's no window to open
+	bool headless = hasArgument(argc, argv, "--bench")
+		|| hasArgument(argc, argv, "--software");
+	if(!headless) {
+		glutInit(&argc, argv);
+		glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+		glutInitWindowSize(512, 512);
+	}
+	parseArguments(argc, argv);
+	meshCache.setIndexing(indexMeshes, weldMeshes, true);
 
-	// get a list of all the mesh data in meshes directory
+	// start reading every file on worker threads, while the window and GL
+	// are set up here
+	Scene::startLoading();
+	LSystemRenderer::startLoading();
 	vector<string>* names = getFileNames("lsystems");
 	std::sort(names->begin(), names->end());
-	vector<LSystem*> lsystems = vector<LSystem*>();
+	vector<std::shared_future<LSystem*> > lsystemLoads;
 	for(vector<string>::const_iterator i = names->begin(); i != names->end(); ++i) {
-		LSystemReader reader((*i).c_str());
-		lsystems.push_back(reader.read());
-		//lsystems[lsystems.size() - 1]->print();
+		lsystemLoads.push_back(assetLoader.takeLSystem(*i));
+	}
+	vector<LSystem*> lsystems = vector<LSystem*>();
+
+	if(headless) {
+		// same size as the window, and the same trees every run
+		OffscreenContext* context = NULL;
+		ShaderProgram* program;
+		if(softwareImage.empty()) {
+			try {
+				context = new OffscreenContext();
+				glewInit();
+				context->createFramebuffer(512, 512);
+			} catch(const runtime_error& e) {
+				cerr << "Can't benchmark: " << e.what() << endl;
+				exit(EXIT_FAILURE);
+			}
+			program = setUpShaders();
+		} else {
+			program = new ShaderProgram("vshader1.glsl", "fshader1.glsl", true);
+		}
+		srand(1);
+		finishLSystems(lsystemLoads, lsystems);
+		createScene(program, lsystems, true);
+		scene->reshape(512, 512);
+		if(benchFrames > 0) {
+			Benchmark benchmark(scene, lsysRenderer);
+			benchmark.run(benchFrames);
+		} else {
+			scene->render();
+		}
+		if(!softwareImage.empty()) {
+			try {
+				scene->getRasterizer()->writeImage(softwareImage);
+			} catch(const runtime_error& e) {
+				cerr << e.what() << endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		delete context;
+		return 0;
 	}
 
 
@@ -165,15 +366,16 @@ int main(int argc, char **argv) {
 	// init glew
 	glewInit();
 
-	GLuint program = setUpShaders();
+	ShaderProgram* program = setUpShaders();
 
 	srand(time(NULL));
+	finishLSystems(lsystemLoads, lsystems);
 	lsystems[0]->print();
 	
-	lsysRenderer = new LSystemRenderer(program, lsystems);
-	
-	scene = new Scene(program, *lsysRenderer);
-	scene->bufferPoints();
+	createScene(program, lsystems, false);
+	if(scene->assetsPending()) {
+		glutIdleFunc(idle); // draw the big meshes once they're read
+	}
 	// assign handlers
 	glutDisplayFunc(display);
 	glutKeyboardFunc(keyboard);
@@ -187,4 +389,3 @@ int main(int argc, char **argv) {
 	glutMainLoop();
 	return 0;
 }
-
@@ -3,12 +3,31 @@
 uniform mat4 projection_matrix;
 uniform mat4 model_matrix;
 uniform mat4 shadow_matrix;
+uniform mat4 position_decode; // undoes how positions were packed
+uniform bool useInstancing;
+uniform bool shadowCopies; // every odd instance is the shadow of the one before
 
 in vec4 vPosition;
-in vec4 vTexCoord;
+in mat4 instance_matrix; // per-instance model matrix, uploaded row major
+in vec4 vColor; // only used by pre-transformed batches
 out vec2 texCoord;
+out vec4 vertexColor;
+flat out int isShadow;
 
 void main() {
-	texCoord = vTexCoord.xz; // want x/z to map to s/t tex coords
-	gl_Position = projection_matrix * shadow_matrix * model_matrix * vPosition;
+	vec4 position = position_decode * vPosition;
+	texCoord = position.xz; // want x/z to map to s/t tex coords
+	vertexColor = vColor;
+	vec4 worldPosition;
+	if(useInstancing) {
+		// rows were read as columns, so multiply from the left instead
+		worldPosition = position * instance_matrix;
+	} else {
+		worldPosition = model_matrix * position;
+	}
+	isShadow = shadowCopies && gl_InstanceID % 2 == 1 ? 1 : 0;
+	if(isShadow == 1) {
+		worldPosition = shadow_matrix * worldPosition;
+	}
+	gl_Position = projection_matrix * worldPosition;
 }